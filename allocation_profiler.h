@@ -0,0 +1,216 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <execinfo.h>
+
+/* Sampling allocation profiler, in the spirit of tcmalloc's: on average one
+   allocation every sample_period bytes records the stack that made it. The gap
+   between samples is drawn from an exponential distribution, so allocations of
+   every size are sampled in proportion to the bytes they take, and periodic
+   allocation patterns cannot hide between samples.
+
+   While stopped, the allocators' hook is one relaxed load and a predictable
+   branch. While running, each thread counts down its bytes to the next sample
+   and only takes the lock and unwinds the stack when it is due.
+
+   The profile is written in the legacy heap profile format of gperftools, which
+   `pprof` reads directly: pprof <binary> <profile>. Frees are not tracked, so
+   the profile covers allocation volume only: use -sample_index=alloc_space or
+   alloc_objects, the in-use views are empty. */
+class AllocationProfiler {
+private:
+    static constexpr int kMaxFrames = 64;
+
+    struct Stack {
+        std::vector<void *> frames;
+
+        bool operator==(const Stack& other) const {
+            return frames == other.frames;
+        }
+    };
+
+    struct StackHash {
+        size_t operator()(const Stack& stack) const {
+            size_t hash = 0;
+            for (auto frame : stack.frames) {
+                hash = hash * 31 + std::hash<void *>()(frame);
+            }
+            return hash;
+        }
+    };
+
+    // Raw sample counts, pprof scales them back up using the sample period
+    struct Totals {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+    };
+
+    static inline std::atomic<size_t> sample_period_{0};
+    // Period of the samples taken so far, also once stopped
+    static inline std::atomic<size_t> profile_period_{0};
+    static inline std::mutex mutex_;
+    static inline std::unordered_map<Stack, Totals, StackHash> samples_;
+
+    struct ThreadState {
+        int64_t bytes_until_sample = 0;
+        size_t period = 0;
+        bool in_profiler = false;
+        std::minstd_rand rng{std::random_device()()};
+    };
+
+    static ThreadState& thread_state() {
+        thread_local ThreadState state;
+        return state;
+    }
+
+public:
+    // Start sampling, one sample every sample_period bytes on average
+    static void start(size_t sample_period = 512 * 1024) {
+        profile_period_.store(sample_period, std::memory_order_relaxed);
+        sample_period_.store(sample_period, std::memory_order_relaxed);
+    }
+
+    static void stop() {
+        sample_period_.store(0, std::memory_order_relaxed);
+    }
+
+    static size_t sample_period() {
+        return sample_period_.load(std::memory_order_relaxed);
+    }
+
+    static bool running() {
+        return sample_period() != 0;
+    }
+
+    static void clear() {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        samples_.clear();
+    }
+
+    /* Start sampling if $ALLOCATION_PROFILE names an output file, with the
+       period from $ALLOCATION_PROFILE_PERIOD if set, and write the profile there
+       when the process exits. Meant to be called at the start of main(), so a
+       profiled run needs no code changes. */
+    static void start_from_env() {
+        static std::string path;
+        if (auto env = std::getenv("ALLOCATION_PROFILE")) {
+            path = env;
+        } else {
+            return;
+        }
+
+        size_t period = 512 * 1024;
+        if (auto env = std::getenv("ALLOCATION_PROFILE_PERIOD")) {
+            period = std::strtoull(env, nullptr, 0);
+        }
+
+        start(period);
+        std::atexit([] {
+            stop();
+            if (!write_profile(path)) {
+                std::cerr << "Could not write the allocation profile to " << path << '\n';
+            }
+        });
+    }
+
+    // Counts an allocation of size bytes and records the current stack if a sample is due
+    static void record(size_t size) {
+        auto& state = thread_state();
+        if (state.in_profiler) {
+            return;
+        }
+
+        const auto period = sample_period();
+        if (period == 0) {
+            return;
+        }
+
+        // A new period takes effect at the next sample of each thread
+        if (state.period == 0) {
+            state.period = period;
+            state.bytes_until_sample = next_sample_gap(state);
+        }
+
+        state.bytes_until_sample -= size;
+        if (state.bytes_until_sample > 0) {
+            return;
+        }
+
+        // Recording may allocate, e.g. when the map grows or backtrace() loads
+        // libgcc, which must not be sampled again if it comes back through a pool
+        state.in_profiler = true;
+        state.period = period;
+        state.bytes_until_sample = next_sample_gap(state);
+
+        void *frames[kMaxFrames];
+        int depth = backtrace(frames, kMaxFrames);
+        // Leave out record() itself
+        Stack stack{std::vector<void *>(frames + std::min(depth, 1), frames + depth)};
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            auto& totals = samples_[std::move(stack)];
+            totals.count++;
+            totals.bytes += size;
+        }
+        state.in_profiler = false;
+    }
+
+    static void write_profile(std::ostream& out) {
+        auto& state = thread_state();
+        state.in_profiler = true;
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            Totals all;
+            for (const auto& [stack, totals] : samples_) {
+                all.count += totals.count;
+                all.bytes += totals.bytes;
+            }
+
+            out << "heap profile: 0: 0 [" << all.count << ": " << all.bytes << "] @ heap_v2/"
+                << profile_period_.load(std::memory_order_relaxed) << '\n';
+            for (const auto& [stack, totals] : samples_) {
+                out << " 0: 0 [" << totals.count << ": " << totals.bytes << "] @";
+                for (auto frame : stack.frames) {
+                    out << ' ' << frame;
+                }
+                out << '\n';
+            }
+        }
+
+        // Lets pprof map the addresses back to binaries and symbols
+        out << "\nMAPPED_LIBRARIES:\n";
+        std::ifstream maps("/proc/self/maps");
+        out << maps.rdbuf();
+        state.in_profiler = false;
+    }
+
+    static bool write_profile(const std::string& path) {
+        std::ofstream out(path);
+        write_profile(out);
+        return static_cast<bool>(out);
+    }
+
+private:
+    static int64_t next_sample_gap(ThreadState& state) {
+        std::exponential_distribution<double> gap(1.0 / state.period);
+        return static_cast<int64_t>(gap(state.rng)) + 1;
+    }
+};
+
+// The hook in the allocators' allocate paths
+inline void profile_allocation(size_t size) {
+    if (__builtin_expect(AllocationProfiler::running(), 0)) {
+        AllocationProfiler::record(size);
+    }
+}
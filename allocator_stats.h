@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "thread_slots.h"
+
+/* Usage counters the pools report to once set_stats() attached them. Several
+   pools can share one AllocatorStats, e.g. all size classes of a SizeClassPool.
+   Chunk counters are kept per thread (one cache line each, indexed by
+   ThreadSlots) and only summed up on read, so the fast paths never write to a
+   shared line. A chunk allocated on one thread and freed on another leaves the
+   per-thread live counts unbalanced, their sum is still exact. Block counters
+   are updated on the slow path only and are plain shared atomics.
+
+   Without attached stats a pool pays one predictable branch per operation. */
+class AllocatorStats {
+public:
+    struct Snapshot {
+        int64_t live_bytes = 0;
+        int64_t allocations = 0;
+        int64_t deallocations = 0;
+        // Requests the pool could not serve and handed to malloc, counted in live_bytes as well
+        int64_t fallback_allocations = 0;
+        int64_t fallback_bytes = 0;
+        // Memory of the blocks currently held, whether their chunks are live or free
+        int64_t reserved_bytes = 0;
+        int64_t peak_reserved_bytes = 0;
+        // Highest live_bytes seen when a block was reserved or stats were read.
+        // Live usage only peaks above that without the pool growing in between.
+        int64_t peak_live_bytes = 0;
+    };
+
+private:
+    struct alignas(64) ThreadCounters {
+        std::atomic<int64_t> live_bytes{0};
+        std::atomic<int64_t> allocations{0};
+        std::atomic<int64_t> deallocations{0};
+        std::atomic<int64_t> fallback_allocations{0};
+        std::atomic<int64_t> fallback_bytes{0};
+    };
+
+    std::unique_ptr<ThreadCounters[]> threads_;
+    std::atomic<int64_t> reserved_bytes_{0};
+    std::atomic<int64_t> peak_reserved_bytes_{0};
+    mutable std::atomic<int64_t> peak_live_bytes_{0};
+
+public:
+    AllocatorStats() : threads_(std::make_unique<ThreadCounters[]>(ThreadSlots::kMaxThreads + 1)) {}
+
+    AllocatorStats(const AllocatorStats&) = delete;
+    AllocatorStats& operator=(const AllocatorStats&) = delete;
+
+    // bytes is the total of count chunks, as for a bulk allocation
+    void on_allocate(size_t bytes, size_t count = 1) {
+        auto id = ThreadSlots::id();
+        add(id, threads_[id].live_bytes, bytes);
+        add(id, threads_[id].allocations, count);
+    }
+
+    void on_deallocate(size_t bytes, size_t count = 1) {
+        auto id = ThreadSlots::id();
+        add(id, threads_[id].live_bytes, -static_cast<int64_t>(bytes));
+        add(id, threads_[id].deallocations, count);
+    }
+
+    void on_fallback_allocate(size_t bytes) {
+        auto id = ThreadSlots::id();
+        on_allocate(bytes);
+        add(id, threads_[id].fallback_allocations, 1);
+        add(id, threads_[id].fallback_bytes, bytes);
+    }
+
+    void on_fallback_deallocate(size_t bytes) {
+        on_deallocate(bytes);
+    }
+
+    void on_reserve(size_t bytes) {
+        auto reserved = reserved_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        update_peak(peak_reserved_bytes_, reserved);
+        update_peak(peak_live_bytes_, live_bytes());
+    }
+
+    void on_release(size_t bytes) {
+        reserved_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    int64_t live_bytes() const {
+        int64_t live = 0;
+        for (size_t i = 0; i <= ThreadSlots::kMaxThreads; i++) {
+            live += threads_[i].live_bytes.load(std::memory_order_relaxed);
+        }
+        return live;
+    }
+
+    // Counters of all threads summed up. Threads updating them concurrently
+    // may be half included, so the fields need not be consistent with each other.
+    Snapshot snapshot() const {
+        Snapshot s;
+        for (size_t i = 0; i <= ThreadSlots::kMaxThreads; i++) {
+            const auto& thread = threads_[i];
+            s.live_bytes += thread.live_bytes.load(std::memory_order_relaxed);
+            s.allocations += thread.allocations.load(std::memory_order_relaxed);
+            s.deallocations += thread.deallocations.load(std::memory_order_relaxed);
+            s.fallback_allocations += thread.fallback_allocations.load(std::memory_order_relaxed);
+            s.fallback_bytes += thread.fallback_bytes.load(std::memory_order_relaxed);
+        }
+
+        s.reserved_bytes = reserved_bytes_.load(std::memory_order_relaxed);
+        s.peak_reserved_bytes = peak_reserved_bytes_.load(std::memory_order_relaxed);
+        update_peak(peak_live_bytes_, s.live_bytes);
+        s.peak_live_bytes = peak_live_bytes_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    // A thread only writes its own counters, so a load and a store do instead of
+    // a locked read-modify-write. Overflow threads share theirs.
+    static void add(size_t id, std::atomic<int64_t>& counter, int64_t value) {
+        if (id == ThreadSlots::kOverflow) {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        } else {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+    }
+
+    static void update_peak(std::atomic<int64_t>& peak, int64_t value) {
+        auto current = peak.load(std::memory_order_relaxed);
+        while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const AllocatorStats::Snapshot& s) {
+    return out << "live=" << s.live_bytes << "B peak_live=" << s.peak_live_bytes
+               << "B reserved=" << s.reserved_bytes << "B peak_reserved=" << s.peak_reserved_bytes
+               << "B allocations=" << s.allocations << " deallocations=" << s.deallocations
+               << " fallbacks=" << s.fallback_allocations << " (" << s.fallback_bytes << "B)";
+}
+
+/* Periodic dump hook: a background thread passes a snapshot of the stats to
+   dump every interval, by default printing it to stderr. The stats must
+   outlive the reporter. */
+class StatsReporter {
+public:
+    using DumpFn = std::function<void(const AllocatorStats::Snapshot&)>;
+
+private:
+    const AllocatorStats& stats_;
+    std::chrono::milliseconds interval_;
+    DumpFn dump_;
+    std::mutex mutex_;
+    std::condition_variable stop_cv_;
+    bool stop_ = false;
+    std::thread thread_;
+
+public:
+    StatsReporter(const AllocatorStats& stats, std::chrono::milliseconds interval,
+                  DumpFn dump = [](const AllocatorStats::Snapshot& s) { std::cerr << s << '\n'; })
+        : stats_(stats), interval_(interval), dump_(std::move(dump)), thread_([this] { run(); }) {}
+
+    StatsReporter(const StatsReporter&) = delete;
+    StatsReporter& operator=(const StatsReporter&) = delete;
+
+    ~StatsReporter() {
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        stop_cv_.notify_one();
+        thread_.join();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_cv_.wait_for(lock, interval_, [this] { return stop_; })) {
+            dump_(stats_.snapshot());
+        }
+    }
+};
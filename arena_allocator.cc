@@ -0,0 +1,45 @@
+#include <list>
+#include "benchmark_util.h"
+#include "arena_allocator.h"
+
+// BENCHMARK CODE
+
+namespace {
+
+// Each request builds a short-lived list and throws it away. With an arena the
+// nodes are never freed individually, the arena is rewound after every request.
+template <typename Allocator, typename ResetFn>
+void run_requests(benchmark::State& state, const Allocator& alloc, ResetFn reset) {
+    constexpr const int kNumRequests = 1000;
+    constexpr const int kNumElems = 1000;
+
+    for (auto _ : state) {
+        for (int r = 0; r < kNumRequests; r++) {
+            {
+                std::list<int, Allocator> l(alloc);
+                for (int i = 0; i < kNumElems; i++) {
+                    l.emplace_back(i);
+                }
+            }
+            reset();
+        }
+    }
+
+    set_operations(state, kNumRequests * kNumElems);
+}
+
+void BM_RequestList_std_allocator(benchmark::State& state) {
+    run_requests(state, std::allocator<int>(), [] {});
+}
+
+template <typename Upstream>
+void BM_RequestList_Arena(benchmark::State& state) {
+    ArenaAllocator<int, Upstream> alloc;
+    run_requests(state, alloc, [&] { alloc.arena().reset(); });
+}
+
+} // namespace
+
+BENCHMARK(BM_RequestList_std_allocator)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_RequestList_Arena, THPAllocator<uint8_t>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_RequestList_Arena, std::allocator<uint8_t>)->Apply(configure);
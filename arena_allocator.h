@@ -0,0 +1,195 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <limits>
+#include <algorithm>
+#include "huge_page_allocator.h"
+
+/* Bump-pointer arena with the semantics of std::pmr::monotonic_buffer_resource:
+   chunks are taken from the Upstream allocator with geometrically growing sizes,
+   deallocate() is a no-op and everything is given back at once by release().
+   reset() additionally rewinds the arena in O(1) and keeps its chunks, so a
+   request-scoped arena stops asking the upstream for memory once it has seen
+   its peak. By default chunks are huge pages from THPAllocator. */
+template <typename Upstream = THPAllocator<uint8_t>>
+class Arena {
+private:
+    // Header at the start of every chunk, chunks are kept in allocation order
+    struct Chunk {
+        Chunk *next;
+        size_t size;
+    };
+
+    static constexpr size_t kGrowthFactor = 2;
+    static constexpr size_t kMaxChunkSize = size_t{1} << 30;
+
+    // Chunks are taken in units of max_align_t, so an upstream aligning to its
+    // value_type (a polymorphic_allocator<uint8_t> asks for an alignment of 1)
+    // still aligns the header and the start of the chunk
+    using Unit = std::max_align_t;
+    using UnitAllocator = typename std::allocator_traits<Upstream>::template rebind_alloc<Unit>;
+
+    UnitAllocator upstream_;
+    Chunk *chunks_ = nullptr;
+    Chunk *last_ = nullptr;
+    Chunk *current_ = nullptr;
+    uintptr_t cur_ = 0;
+    uintptr_t end_ = 0;
+    size_t next_chunk_size_;
+
+public:
+    explicit Arena(size_t initial_size = 1 << 21, const Upstream& upstream = Upstream())
+        : upstream_(upstream), next_chunk_size_(round_up(std::max(initial_size, sizeof(Chunk)))) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        release();
+    }
+
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        auto ptr = (cur_ + alignment - 1) & ~(alignment - 1);
+        if (ptr == 0 || ptr > end_ || size > end_ - ptr) {
+            ptr = next_chunk(size, alignment);
+        }
+
+        cur_ = ptr + size;
+        return reinterpret_cast<void *>(ptr);
+    }
+
+    void deallocate(void *ptr, size_t size) {
+        (void) ptr;
+        (void) size;
+    }
+
+    // Forget every allocation but keep the chunks for reuse
+    void reset() {
+        current_ = chunks_;
+        if (current_ != nullptr) {
+            enter(current_);
+        }
+    }
+
+    // Give every chunk back to the upstream allocator
+    void release() {
+        while (chunks_ != nullptr) {
+            auto next = chunks_->next;
+            upstream_.deallocate(reinterpret_cast<Unit *>(chunks_), chunks_->size / sizeof(Unit));
+            chunks_ = next;
+        }
+
+        last_ = current_ = nullptr;
+        cur_ = end_ = 0;
+    }
+
+private:
+    static size_t round_up(size_t size) {
+        return (size + sizeof(Unit) - 1) / sizeof(Unit) * sizeof(Unit);
+    }
+
+    void enter(Chunk *chunk) {
+        cur_ = reinterpret_cast<uintptr_t>(chunk) + sizeof(Chunk);
+        end_ = reinterpret_cast<uintptr_t>(chunk) + chunk->size;
+    }
+
+    // Move on to the next retained chunk that fits, or get a new one from upstream
+    uintptr_t next_chunk(size_t size, size_t alignment) {
+        if (size > std::numeric_limits<size_t>::max() / 2 - alignment) {
+            throw std::bad_alloc();
+        }
+
+        const auto needed = sizeof(Chunk) + alignment - 1 + size;
+        while (current_ != nullptr && current_->next != nullptr) {
+            current_ = current_->next;
+            if (current_->size >= needed) {
+                enter(current_);
+                return (cur_ + alignment - 1) & ~(alignment - 1);
+            }
+        }
+
+        while (next_chunk_size_ < needed) {
+            next_chunk_size_ *= kGrowthFactor;
+        }
+
+        auto chunk = reinterpret_cast<Chunk *>(upstream_.allocate(next_chunk_size_ / sizeof(Unit)));
+        chunk->next = nullptr;
+        chunk->size = next_chunk_size_;
+        if (next_chunk_size_ < kMaxChunkSize) {
+            next_chunk_size_ *= kGrowthFactor;
+        }
+
+        if (last_ != nullptr) {
+            last_->next = chunk;
+        } else {
+            chunks_ = chunk;
+        }
+        last_ = current_ = chunk;
+
+        enter(chunk);
+        return (cur_ + alignment - 1) & ~(alignment - 1);
+    }
+};
+
+// Copies and rebound copies share the same arena
+template <typename T, typename Upstream = THPAllocator<uint8_t>>
+class ArenaAllocator {
+private:
+    template <typename U, typename>
+    friend class ArenaAllocator;
+
+    using ArenaType = Arena<Upstream>;
+    std::shared_ptr<ArenaType> arena_;
+
+public:
+    using value_type = T;
+    using is_always_equal = std::false_type;
+
+    ArenaAllocator() : arena_(std::make_shared<ArenaType>()) {}
+
+    explicit ArenaAllocator(std::shared_ptr<ArenaType> arena) : arena_(std::move(arena)) {}
+
+    // Rebind copy constructor
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U, Upstream>& other) : arena_{other.arena_} {}
+
+    template <typename U>
+    struct rebind {
+        using other = ArenaAllocator<U, Upstream>;
+    };
+
+    ArenaAllocator(const ArenaAllocator& other) = default;
+    ArenaAllocator(ArenaAllocator&& other) = default;
+    ArenaAllocator& operator=(const ArenaAllocator& other) = default;
+    ArenaAllocator& operator=(ArenaAllocator&& other) = default;
+
+    T* allocate(size_t n) {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+
+        return static_cast<T*>(arena_->allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        (void) ptr;
+        (void) n;
+    }
+
+    ArenaType& arena() const {
+        return *arena_;
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U, Upstream>& other) const {
+        return arena_ == other.arena_;
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U, Upstream>& other) const {
+        return arena_ != other.arena_;
+    }
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+// Linear interpolation between the closest ranks of sorted values, p in [0, 1]
+inline double sorted_percentile(const std::vector<double>& values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+
+    const double rank = p * (values.size() - 1);
+    const size_t lower = rank;
+    const size_t upper = std::min(lower + 1, values.size() - 1);
+    return values[lower] + (rank - lower) * (values[upper] - values[lower]);
+}
+
+inline double percentile(std::vector<double> values, double p) {
+    std::sort(values.begin(), values.end());
+    return sorted_percentile(values, p);
+}
+
+/* Settings shared by every benchmark: a warmup so page faults of the first run
+   and frequency ramp-up do not end up in the numbers, and percentiles over the
+   repetitions next to the mean/median/stddev Google Benchmark already reports.
+   Repetitions are left to --benchmark_repetitions (see `make bench`). */
+inline void configure(benchmark::internal::Benchmark *b) {
+    b->Unit(benchmark::kMicrosecond)
+        ->MinWarmUpTime(0.1)
+        ->ComputeStatistics("p90", [](const std::vector<double>& v) { return percentile(v, 0.90); })
+        ->ComputeStatistics("p99", [](const std::vector<double>& v) { return percentile(v, 0.99); })
+        ->ComputeStatistics("max", [](const std::vector<double>& v) { return percentile(v, 1.0); });
+}
+
+// Report throughput and the average time of one operation, given how many
+// operations (allocations, element updates, ...) a single iteration performs
+inline void set_operations(benchmark::State& state, int64_t ops_per_iteration) {
+    const auto ops = ops_per_iteration * static_cast<int64_t>(state.iterations());
+    state.SetItemsProcessed(ops);
+    state.counters["time/op"] = benchmark::Counter(ops, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+// Times individual operations to report the tail latency that averages hide.
+// steady_clock costs a few tens of ns, so this is for distributions, not means.
+// Once `capacity` samples are recorded, further operations run untimed.
+class LatencySamples {
+private:
+    std::vector<double> samples_;
+
+public:
+    explicit LatencySamples(size_t capacity = 1 << 20) {
+        samples_.reserve(capacity);
+    }
+
+    template <typename F>
+    void time(F&& f) {
+        if (samples_.size() == samples_.capacity()) {
+            f();
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto stop = std::chrono::steady_clock::now();
+        samples_.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+    }
+
+    void report(benchmark::State& state) {
+        std::sort(samples_.begin(), samples_.end());
+        state.counters["p50_ns"] = sorted_percentile(samples_, 0.50);
+        state.counters["p99_ns"] = sorted_percentile(samples_, 0.99);
+        state.counters["p999_ns"] = sorted_percentile(samples_, 0.999);
+        state.counters["max_ns"] = sorted_percentile(samples_, 1.0);
+    }
+};
@@ -0,0 +1,23 @@
+#include <cstdlib>
+#include "benchmark_util.h"
+#include "allocation_profiler.h"
+
+// Every allocator registers its benchmarks from its own .cc file, they are all
+// linked into one binary. The malloc in use is recorded in the context, so runs
+// under LD_PRELOAD=libjemalloc.so etc. can be told apart (see `make compare`).
+// Set ALLOCATION_PROFILE=<file> to also collect an allocation profile.
+int main(int argc, char **argv) {
+    AllocationProfiler::start_from_env();
+
+    const char *preload = std::getenv("LD_PRELOAD");
+    benchmark::AddCustomContext("malloc", preload != nullptr && *preload != '\0' ? preload : "glibc");
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
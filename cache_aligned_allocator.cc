@@ -1,46 +1,20 @@
-#include <iostream>
+#include <atomic>
 #include <vector>
 #include <thread>
-#include <mutex>
 #include <random>
-#include <atomic>
-#include <chrono>
-#include <assert.h>
-
-template <typename T, size_t Alignment = 64>
-class CacheAlignedAllocator {
-public:
-    using value_type = T;
-    using is_always_equal = std::true_type;
-
-    template <typename U>
-    struct rebind {
-        using other = CacheAlignedAllocator<U, Alignment>;
-    };
-
-    CacheAlignedAllocator() = default;
-
-    template <typename U>
-    CacheAlignedAllocator(const CacheAlignedAllocator<U, Alignment>& other) {
-        (void) other;
-    }
-
-    T* allocate(size_t n) {
-        auto ptr = static_cast<T*>(aligned_alloc(Alignment, sizeof(T) * n));
-        if (ptr)
-            return ptr;
-
-        throw std::bad_alloc();
-    }
-
-    void deallocate(T* ptr, size_t n) {
-        (void) n;
-        free(ptr);
-    }
-};
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <pthread.h>
+#include "benchmark_util.h"
+#include "perf_counters.h"
+#include "cache_aligned_allocator.h"
+#include "sharded.h"
 
 // BENCHMARK CODE
 
+namespace {
+
 void pin_thread(int cpu) {
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
@@ -51,70 +25,156 @@ void pin_thread(int cpu) {
     }
 }
 
-template <typename T, typename Allocator = std::allocator<T>>
-int64_t run_benchmark() {
-    const static int kNumThreads = std::thread::hardware_concurrency();
-    const static int kNumElems = kNumThreads;
+using Slot = std::atomic<uint64_t>;
+
+/* Every thread owns one slot of the vector: even threads keep writing random
+   values to theirs, odd threads keep reading theirs. No two threads touch the
+   same slot, so there is no true sharing and no locking; any slowdown is from
+   slots of different threads sharing a cache line (false sharing). Packed
+   layouts put 8 slots on a line, padded ones give every slot its own line. */
+template <typename T, typename Allocator>
+void BM_FalseSharing(benchmark::State& state) {
+    constexpr const int kRounds = 1 << 20;
+    const int kNumCpus = std::max(1u, std::thread::hardware_concurrency());
+    const int kNumThreads = state.range(0);
+
+    std::vector<T, Allocator> vec(kNumThreads);
+    PerfCounters counters;
+    counters.start();
+
+    for (auto _ : state) {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kNumThreads; i++) {
+            threads.emplace_back([&, i] () {
+                pin_thread(i % kNumCpus);
+                Slot& slot = vec[i];
+
+                if (i % 2 == 0) {
+                    std::minstd_rand rng(i);
+                    for (int j = 0; j < kRounds; j++) {
+                        slot.store(rng(), std::memory_order_relaxed);
+                    }
+                } else {
+                    uint64_t sum = 0;
+                    for (int j = 0; j < kRounds; j++) {
+                        sum += slot.load(std::memory_order_relaxed);
+                    }
+                    benchmark::DoNotOptimize(sum);
+                }
+            });
+        }
+
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    set_operations(state, int64_t{kRounds} * kNumThreads);
+    for (const auto& [name, count] : counters.stop()) {
+        state.counters[name] = benchmark::Counter(count, benchmark::Counter::kAvgIterations);
+    }
+    if (!counters.available()) {
+        state.SetLabel("no perf counters");
+    }
+}
+
+void thread_counts(benchmark::internal::Benchmark *b) {
+    configure(b);
+    b->UseRealTime()->RangeMultiplier(2)->Range(2, std::max(2u, std::thread::hardware_concurrency()));
+}
+
+// Counters every thread bumps on each request, the pattern cache alignment is
+// actually needed for
+struct AtomicCounter {
+    std::atomic<uint64_t> value{0};
+
+    void add() { value.fetch_add(1, std::memory_order_relaxed); }
+    uint64_t read() const { return value.load(std::memory_order_relaxed); }
+};
 
-    std::random_device rd;
-    std::mt19937 rng(rd());
-    std::uniform_int_distribution<int> uni(0, kNumElems-1);
+/* The mutex-per-element pattern the false-sharing benchmark started out
+   with: packed vectors of values and of their mutexes, one element per CPU
+   here. Threads on different CPUs take different locks, but the locks and
+   the values still share cache lines. */
+struct MutexPerElementCounter {
+    std::vector<uint64_t> values = std::vector<uint64_t>(get_nprocs_conf());
+    std::vector<std::mutex> mutexes = std::vector<std::mutex>(get_nprocs_conf());
+
+    void add() {
+        const auto i = current_cpu() % values.size();
+        std::scoped_lock<std::mutex> lock(mutexes[i]);
+        values[i]++;
+    }
 
-    std::vector<int, Allocator> vec(kNumElems, 0);
-    std::vector<std::mutex> mutexes(kNumElems);
-    std::vector<std::thread> threads;
+    uint64_t read() {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < values.size(); i++) {
+            std::scoped_lock<std::mutex> lock(mutexes[i]);
+            sum += values[i];
+        }
+        return sum;
+    }
+};
 
-    auto start = std::chrono::steady_clock::now();
+struct ShardedCounter {
+    sharded<std::atomic<uint64_t>> slots;
 
-    // Writing threads - these will invalidate the cache of the reading threads
-    for (int i = 0; i < kNumThreads / 2; i++) {
-        threads.emplace_back([&] () {
-            pin_thread(i);
+    void add() { slots.local().fetch_add(1, std::memory_order_relaxed); }
 
-            for (int j = 0; j < 1000000; j++) {
-                for (int k = 0; k < kNumElems; k++) {
-                    std::scoped_lock<std::mutex> lock(mutexes[k]);
-                    vec[k] = uni(rng);
-                }
-            }
-        });
+    uint64_t read() const {
+        uint64_t sum = 0;
+        for (const auto& slot : slots) {
+            sum += slot->load(std::memory_order_relaxed);
+        }
+        return sum;
     }
+};
 
-    // Reading threads
-    for (int i = kNumThreads / 2; i < kNumThreads; i++) {
-        threads.emplace_back([&] () {
-            pin_thread(i);
-            
-            volatile int r = 0;
-            for (int j = 0; j < 1000000; j++) {
-                for (int k = 0; k < kNumElems; k++) {
-                    std::scoped_lock<std::mutex> lock(mutexes[k]);
-                    r += vec[k];
+/* range(0) threads incrementing one shared counter, unpinned so the scheduler
+   may migrate them (which ShardedCounter has to cope with). The single atomic
+   bounces one cache line between all cores, the packed per-element mutexes
+   a few, the sharded counter only pays for it on read. */
+template <typename Counter>
+void BM_SharedCounter(benchmark::State& state) {
+    constexpr const int kRounds = 1 << 20;
+    const int kNumThreads = state.range(0);
+    Counter counter;
+
+    for (auto _ : state) {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kNumThreads; i++) {
+            threads.emplace_back([&] () {
+                for (int j = 0; j < kRounds; j++) {
+                    counter.add();
                 }
-            }
-        });
-    }
+            });
+        }
 
-    for (auto& t : threads) {
-        t.join();
+        for (auto& t : threads) {
+            t.join();
+        }
     }
 
-    auto stop = std::chrono::steady_clock::now();
-    return std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
+    if (counter.read() != uint64_t{kRounds} * kNumThreads * state.iterations()) {
+        state.SkipWithError("lost updates");
+    }
+    set_operations(state, int64_t{kRounds} * kNumThreads);
 }
 
-int main() {
-    constexpr int iterations = 10;
-    int64_t std_alloc_mean = 0;
-    int64_t custom_alloc_mean = 0;
+} // namespace
 
-    for (int i = 0; i < iterations; i++) {
-        std_alloc_mean += run_benchmark<int>();
-        custom_alloc_mean += run_benchmark<int, CacheAlignedAllocator<int>>();
-    }
+// Packed: the start of the vector is cache aligned at best, the slots are not
+BENCHMARK_TEMPLATE(BM_FalseSharing, Slot, std::allocator<Slot>)->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_FalseSharing, Slot, CacheAlignedAllocator<Slot>)->Apply(thread_counts);
 
-    std::cout << "std::allocator mean: " << std_alloc_mean / iterations << '\n';
-    std::cout << "CachedAlignedAllocator mean: " << custom_alloc_mean / iterations << '\n';
+// Padded to 64 bytes, and to 128 bytes against the adjacent-line prefetcher
+BENCHMARK_TEMPLATE(BM_FalseSharing, cache_padded<Slot>, padded_vector<Slot>::allocator_type)
+    ->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_FalseSharing, cache_padded<Slot, 128>, padded_vector<Slot, 128>::allocator_type)
+    ->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_FalseSharing, cache_padded<Slot>, CacheAlignedAllocator<cache_padded<Slot>, 64, NumaLocal>)
+    ->Apply(thread_counts);
 
-    return 0;
-}
\ No newline at end of file
+BENCHMARK_TEMPLATE(BM_SharedCounter, AtomicCounter)->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_SharedCounter, MutexPerElementCounter)->Apply(thread_counts);
+BENCHMARK_TEMPLATE(BM_SharedCounter, ShardedCounter)->Apply(thread_counts);
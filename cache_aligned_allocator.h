@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "numa_policy.h"
+#include "page_backing.h"
+#include "allocation_profiler.h"
+#include "hardening.h"
+
+// With a Numa policy other than NumaDefault, buffers are mapped with mmap,
+// since a memory policy can only be set on whole pages. So are buffers of at
+// least a page in hardened builds, to put guard pages around them (a mapping
+// per list node would soon hit vm.max_map_count, smaller buffers are left to
+// the redzones of ASan).
+template <typename T, size_t Alignment = 64, typename Numa = NumaDefault>
+class CacheAlignedAllocator {
+private:
+    // Never align below what T itself requires, e.g. a cache_padded<T, 128>
+    static constexpr size_t kAlignment = std::max(Alignment, alignof(T));
+    static constexpr bool kUseMmap = !std::is_same_v<Numa, NumaDefault>;
+
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    template <typename U>
+    struct rebind {
+        using other = CacheAlignedAllocator<U, Alignment, Numa>;
+    };
+
+    CacheAlignedAllocator() = default;
+
+    template <typename U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U, Alignment, Numa>& other) {
+        (void) other;
+    }
+
+    T* allocate(size_t n) {
+        profile_allocation(sizeof(T) * n);
+        if (is_guarded(n)) {
+            auto ptr = hardening::map_guarded(sizeof(T) * n, kAlignment);
+            Numa::apply(reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(ptr) & ~(page_round_up(1) - 1)),
+                        page_round_up(sizeof(T) * n));
+            return static_cast<T*>(ptr);
+        }
+
+        if constexpr (kUseMmap) {
+            // mmap() alone only aligns to a page, which may be less than Alignment
+            auto size = page_round_up(sizeof(T) * n);
+            auto ptr = map_aligned(size, std::max(kAlignment, page_round_up(1)));
+            if (ptr == nullptr) {
+                throw std::bad_alloc();
+            }
+
+            Numa::apply(ptr, size);
+            return static_cast<T*>(ptr);
+        }
+
+        // aligned_alloc() wants a multiple of the alignment, which ASan enforces
+        auto size = (sizeof(T) * n + kAlignment - 1) & ~(kAlignment - 1);
+        auto ptr = static_cast<T*>(aligned_alloc(kAlignment, size));
+        if (ptr)
+            return ptr;
+
+        throw std::bad_alloc();
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (is_guarded(n)) {
+            hardening::unmap_guarded(ptr, sizeof(T) * n);
+            return;
+        }
+
+        if constexpr (kUseMmap) {
+            munmap(ptr, page_round_up(sizeof(T) * n));
+            return;
+        }
+
+        (void) n;
+        free(ptr);
+    }
+
+private:
+    static bool is_guarded(size_t n) {
+        return hardening::kEnabled && sizeof(T) * n >= page_round_up(1);
+    }
+
+    static size_t page_round_up(size_t size) {
+        static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+        return (size + kPageSize - 1) & ~(kPageSize - 1);
+    }
+};
+
+// The allocator only aligns the start of a buffer, so consecutive elements still
+// share cache lines. cache_padded<T> gives each element a line of its own, use an
+// Alignment of 128 to also keep the adjacent-line prefetcher from pairing lines.
+template <typename T, size_t Alignment = 64>
+struct alignas(Alignment) cache_padded {
+    T value;
+
+    cache_padded() = default;
+
+    template <typename... Args, typename = std::enable_if_t<std::is_constructible_v<T, Args...>>>
+    cache_padded(Args&&... args) : value(std::forward<Args>(args)...) {}
+
+    T& operator*() { return value; }
+    const T& operator*() const { return value; }
+    T* operator->() { return &value; }
+    const T* operator->() const { return &value; }
+
+    operator T&() { return value; }
+    operator const T&() const { return value; }
+};
+
+// A vector with every element on its own Alignment-sized slot
+template <typename T, size_t Alignment = 64>
+using padded_vector = std::vector<cache_padded<T, Alignment>,
+                                  CacheAlignedAllocator<cache_padded<T, Alignment>, Alignment>>;
@@ -0,0 +1,482 @@
+#pragma once
+
+#include <stack>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include "thread_slots.h"
+#include "tagged_stack.h"
+#include "allocator_stats.h"
+#include "page_backing.h"
+#include "hardening.h"
+#include "pool_allocator.h"
+
+// Chunk sizes are rounded up to a multiple of Alignment, and blocks are aligned
+// to at least alignof(std::max_align_t), Alignment and the largest power of two
+// dividing the chunk size. So chunks are aligned to all three, and power-of-two
+// chunks to their size.
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t MagazineSize = 64, size_t Alignment = 1>
+class ConcurrentPool {
+private:
+    static_assert((Alignment & (Alignment - 1)) == 0, "Alignment must be a power of two");
+    static constexpr size_t kBlockAlignment = std::max(Alignment, alignof(std::max_align_t));
+
+    struct BlockDeleter {
+        size_t alignment;
+
+        void operator()(uint8_t *block) const {
+            ::operator delete[](block, std::align_val_t{alignment});
+        }
+    };
+
+    // A magazine is a fixed-capacity stack of free chunks owned by one thread at a time
+    struct Magazine {
+        std::atomic<Magazine *> next{nullptr};
+        size_t count = 0;
+        void *rounds[MagazineSize];
+    };
+
+    // Magazines are only freed when the pool is destroyed, so the depots can
+    // always read next of a magazine
+    using Depot = TaggedStack<Magazine>;
+
+    // Each thread keeps a loaded and a previous magazine, so a thread alternating
+    // between allocate and deallocate at a magazine boundary does not hit the depot
+    struct alignas(64) Cache {
+        Magazine *loaded = nullptr;
+        Magazine *previous = nullptr;
+    };
+
+    size_t size_;
+    size_t block_alignment_;
+    Depot full_;
+    Depot empty_;
+    std::unique_ptr<Cache[]> caches_;
+    std::mutex overflow_mutex_;
+    std::mutex blocks_mutex_;
+    std::stack<std::unique_ptr<uint8_t[], BlockDeleter>> blocks_;
+    AllocatorStats *stats_ = nullptr;
+
+public:
+    explicit ConcurrentPool(size_t size)
+        : size_(chunk_size(size)), block_alignment_(std::max(kBlockAlignment, size_ & (~size_ + 1))),
+          caches_(std::make_unique<Cache[]>(ThreadSlots::kMaxThreads + 1)) {
+        for (size_t i = 0; i < ReservedBlocks; i++) {
+            add_more_addresses(nullptr);
+        }
+    }
+
+    // Grow to at least blocks blocks now, optionally with their pages faulted
+    // in, instead of fixing ReservedBlocks at compile time
+    void reserve(size_t blocks, bool prefault = false) {
+        for (;;) {
+            {
+                std::scoped_lock<std::mutex> lock(blocks_mutex_);
+                if (blocks_.size() >= blocks) {
+                    return;
+                }
+            }
+            add_more_addresses(nullptr, prefault);
+        }
+    }
+
+    ConcurrentPool(const ConcurrentPool&) = delete;
+    ConcurrentPool& operator=(const ConcurrentPool&) = delete;
+
+    ~ConcurrentPool() {
+        for (size_t i = 0; i <= ThreadSlots::kMaxThreads; i++) {
+            delete caches_[i].loaded;
+            delete caches_[i].previous;
+        }
+
+        while (auto mag = full_.pop()) {
+            delete mag;
+        }
+        while (auto mag = empty_.pop()) {
+            delete mag;
+        }
+
+        if (stats_ != nullptr) {
+            stats_->on_release(blocks_.size() * BlockSize);
+        }
+        if constexpr (hardening::kEnabled) {
+            for (; !blocks_.empty(); blocks_.pop()) {
+                hardening::unpoison(blocks_.top().get(), BlockSize);
+            }
+        }
+    }
+
+    void* allocate() {
+        if (stats_ != nullptr) {
+            stats_->on_allocate(size_);
+        }
+
+        auto id = ThreadSlots::id();
+        if (id == ThreadSlots::kOverflow) {
+            std::scoped_lock<std::mutex> lock(overflow_mutex_);
+            return allocate(caches_[id]);
+        }
+
+        return allocate(caches_[id]);
+    }
+
+    // Chunks may be freed from any thread, they simply join that thread's cache
+    void deallocate(void *ptr) {
+        if (stats_ != nullptr) {
+            stats_->on_deallocate(size_);
+        }
+
+        auto id = ThreadSlots::id();
+        if (id == ThreadSlots::kOverflow) {
+            std::scoped_lock<std::mutex> lock(overflow_mutex_);
+            deallocate(caches_[id], ptr);
+            return;
+        }
+
+        deallocate(caches_[id], ptr);
+    }
+
+    /* Allocate n chunks into out[0, n) at once, copying whole runs of rounds out
+       of the thread's magazines instead of popping them one by one. With n of a
+       magazine or more, every refill copies out a whole magazine from the depot. */
+    template <typename T>
+    void allocate_bulk(size_t n, T **out) {
+        auto id = ThreadSlots::id();
+        if (id == ThreadSlots::kOverflow) {
+            std::scoped_lock<std::mutex> lock(overflow_mutex_);
+            allocate_bulk(caches_[id], n, out);
+        } else {
+            allocate_bulk(caches_[id], n, out);
+        }
+
+        if (stats_ != nullptr) {
+            stats_->on_allocate(n * size_, n);
+        }
+    }
+
+    // Free n chunks at once into the thread's magazines, from any thread
+    template <typename T>
+    void deallocate_bulk(T *const *ptrs, size_t n) {
+        if (stats_ != nullptr) {
+            stats_->on_deallocate(n * size_, n);
+        }
+
+        auto id = ThreadSlots::id();
+        if (id == ThreadSlots::kOverflow) {
+            std::scoped_lock<std::mutex> lock(overflow_mutex_);
+            deallocate_bulk(caches_[id], ptrs, n);
+            return;
+        }
+
+        deallocate_bulk(caches_[id], ptrs, n);
+    }
+
+    /* Same contract as Pool::set_stats(). Attach the stats before the pool is
+       shared with other threads, the pointer itself is not synchronized. */
+    void set_stats(AllocatorStats *stats) {
+        std::scoped_lock<std::mutex> lock(blocks_mutex_);
+        if (stats_ != nullptr) {
+            stats_->on_release(blocks_.size() * BlockSize);
+        }
+        stats_ = stats;
+        if (stats_ != nullptr) {
+            stats_->on_reserve(blocks_.size() * BlockSize);
+        }
+    }
+
+    AllocatorStats* stats() const {
+        return stats_;
+    }
+
+private:
+    void* allocate(Cache& cache) {
+        load_magazines(cache);
+        if (cache.loaded->count == 0) {
+            reload(cache);
+        }
+
+        auto chunk = cache.loaded->rounds[--cache.loaded->count];
+        hardening::check_freed(chunk, size_);
+        return chunk;
+    }
+
+    void deallocate(Cache& cache, void *ptr) {
+        load_magazines(cache);
+        if (cache.loaded->count == MagazineSize) {
+            unload(cache);
+        }
+
+        hardening::fill_freed(ptr, size_);
+        cache.loaded->rounds[cache.loaded->count++] = ptr;
+    }
+
+    template <typename T>
+    void allocate_bulk(Cache& cache, size_t n, T **out) {
+        load_magazines(cache);
+        for (size_t taken = 0; taken < n;) {
+            if (cache.loaded->count == 0) {
+                try {
+                    reload(cache);
+                } catch (...) {
+                    deallocate_bulk(cache, out, taken);
+                    throw;
+                }
+            }
+
+            auto count = std::min(n - taken, cache.loaded->count);
+            cache.loaded->count -= count;
+            std::transform(&cache.loaded->rounds[cache.loaded->count], &cache.loaded->rounds[cache.loaded->count + count],
+                           out + taken, [this](void *chunk) {
+                               hardening::check_freed(chunk, size_);
+                               return static_cast<T *>(chunk);
+                           });
+            taken += count;
+        }
+    }
+
+    template <typename T>
+    void deallocate_bulk(Cache& cache, T *const *ptrs, size_t n) {
+        load_magazines(cache);
+        for (size_t given = 0; given < n;) {
+            if (cache.loaded->count == MagazineSize) {
+                unload(cache);
+            }
+
+            auto count = std::min(n - given, MagazineSize - cache.loaded->count);
+            if constexpr (hardening::kEnabled) {
+                for (size_t i = given; i < given + count; i++) {
+                    hardening::fill_freed(ptrs[i], size_);
+                }
+            }
+            std::copy_n(ptrs + given, count, &cache.loaded->rounds[cache.loaded->count]);
+            cache.loaded->count += count;
+            given += count;
+        }
+    }
+
+    void load_magazines(Cache& cache) {
+        if (cache.loaded == nullptr) {
+            cache.loaded = get_empty_magazine();
+            cache.previous = get_empty_magazine();
+        }
+    }
+
+    // Make the empty loaded magazine a non-empty one
+    void reload(Cache& cache) {
+        if (cache.previous->count > 0) {
+            std::swap(cache.loaded, cache.previous);
+        } else if (auto mag = full_.pop()) {
+            empty_.push(cache.previous);
+            cache.previous = cache.loaded;
+            cache.loaded = mag;
+        } else {
+            add_more_addresses(cache.loaded);
+        }
+    }
+
+    // Make the full loaded magazine a non-full one
+    void unload(Cache& cache) {
+        if (cache.previous->count == 0) {
+            std::swap(cache.loaded, cache.previous);
+        } else {
+            full_.push(cache.previous);
+            cache.previous = cache.loaded;
+            cache.loaded = get_empty_magazine();
+        }
+    }
+
+    // Consecutive chunks of a block stay aligned
+    static constexpr size_t chunk_size(size_t size) {
+        return (std::max<size_t>(size, 1) + Alignment - 1) / Alignment * Alignment;
+    }
+
+    Magazine* get_empty_magazine() {
+        if (auto mag = empty_.pop()) {
+            return mag;
+        }
+
+        return new Magazine;
+    }
+
+    // Allocate another block and divide it into chunks of size_ bytes. The chunks
+    // first fill the caller's empty magazine (if any), the rest go to the depot.
+    void add_more_addresses(Magazine *loaded, bool populate = false) {
+        std::unique_ptr<uint8_t[], BlockDeleter> block(
+            static_cast<uint8_t *>(::operator new[](BlockSize, std::align_val_t{block_alignment_})),
+            BlockDeleter{block_alignment_});
+        const auto num_chunks = BlockSize / size_;
+        if (num_chunks == 0) {
+            throw std::bad_alloc();
+        }
+        if (populate) {
+            prefault(block.get(), BlockSize);
+        }
+        hardening::fill_freed(block.get(), num_chunks * size_);
+        auto mag = loaded ? loaded : get_empty_magazine();
+
+        for (size_t i = 0; i < num_chunks * size_; i += size_) {
+            if (mag->count == MagazineSize) {
+                if (mag != loaded) {
+                    full_.push(mag);
+                }
+                mag = get_empty_magazine();
+            }
+
+            mag->rounds[mag->count++] = &block.get()[i];
+        }
+
+        if (mag != loaded) {
+            full_.push(mag);
+        }
+
+        std::scoped_lock<std::mutex> lock(blocks_mutex_);
+        blocks_.push(std::move(block));
+        if (stats_ != nullptr) {
+            stats_->on_reserve(BlockSize);
+        }
+    }
+};
+
+// ConcurrentPool with MagazineSize fixed, in the shape PoolRegistry takes. Not
+// nested in the allocator, so all rebound copies name the same registry type.
+template <size_t MagazineSize>
+struct ConcurrentPools {
+    template <size_t BlockSize, size_t ReservedBlocks, size_t Alignment>
+    using type = ConcurrentPool<BlockSize, ReservedBlocks, MagazineSize, Alignment>;
+};
+
+/* The thread safe counterpart of PoolAllocator: copies and rebound copies
+   share a PoolRegistry of ConcurrentPools, so every rebound type gets the pool
+   for its own size and alignment, and arrays come from the registry's array
+   classes (only ones above PoolRegistry::kMaxArraySize fall back to malloc).
+   The registry's lock is only taken when a pool is created. */
+template <typename T, size_t BlockSize = 4096, size_t MagazineSize = 64, size_t Alignment = 1>
+class ConcurrentPoolAllocator {
+private:
+    template <typename U, size_t, size_t, size_t>
+    friend class ConcurrentPoolAllocator;
+
+    // Never align below what T itself requires
+    static constexpr size_t kAlignment = std::max(Alignment, alignof(T));
+
+    // The chunk size ConcurrentPool rounds sizeof(T) up to
+    static constexpr size_t kChunkSize = (sizeof(T) + kAlignment - 1) / kAlignment * kAlignment;
+    static constexpr size_t kChunksPerBlock = BlockSize / kChunkSize;
+    static_assert(kChunksPerBlock > 0, "T does not fit in a block of BlockSize bytes");
+
+    using Registry = PoolRegistry<0, ConcurrentPools<MagazineSize>::template type>;
+    using PoolType = ConcurrentPool<BlockSize, 0, MagazineSize, kAlignment>;
+    std::shared_ptr<Registry> registry_;
+    PoolType *pool_;
+
+public:
+    using value_type = T;
+    using is_always_equal = std::false_type;
+
+    ConcurrentPoolAllocator() : ConcurrentPoolAllocator(std::make_shared<Registry>()) {}
+
+    explicit ConcurrentPoolAllocator(std::shared_ptr<Registry> registry)
+        : registry_(std::move(registry)), pool_(&registry_->template pool<BlockSize, 0, kAlignment>(sizeof(T))) {}
+
+    // Rebind copy constructor
+    template <typename U>
+    ConcurrentPoolAllocator(const ConcurrentPoolAllocator<U, BlockSize, MagazineSize, Alignment>& other)
+        : ConcurrentPoolAllocator(other.registry_) {}
+
+    template <typename U>
+    struct rebind {
+        using other = ConcurrentPoolAllocator<U, BlockSize, MagazineSize, Alignment>;
+    };
+
+    ConcurrentPoolAllocator(const ConcurrentPoolAllocator& other) = default;
+    ConcurrentPoolAllocator(ConcurrentPoolAllocator&& other) = default;
+    ConcurrentPoolAllocator& operator=(const ConcurrentPoolAllocator& other) = default;
+    ConcurrentPoolAllocator& operator=(ConcurrentPoolAllocator&& other) = default;
+
+    T* allocate(size_t n) {
+        if (n == 1) {
+            return static_cast<T*>(pool_->allocate());
+        }
+
+        if (n > (std::numeric_limits<size_t>::max() - kAlignment) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+
+        const auto bytes = array_size(n);
+        if (bytes <= Registry::kMaxArraySize) {
+            return static_cast<T*>(registry_->allocate_array(bytes));
+        }
+
+        if (auto stats = registry_->stats()) {
+            stats->on_fallback_allocate(bytes);
+        }
+        auto ptr = kAlignment > alignof(std::max_align_t) ? aligned_alloc(kAlignment, bytes) : malloc(bytes);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (n == 1) {
+            pool_->deallocate(ptr);
+            return;
+        }
+
+        const auto bytes = array_size(n);
+        if (bytes <= Registry::kMaxArraySize) {
+            registry_->deallocate_array(ptr, bytes);
+            return;
+        }
+
+        if (auto stats = registry_->stats()) {
+            stats->on_fallback_deallocate(bytes);
+        }
+        free(ptr);
+    }
+
+    // n single objects at once, freed with deallocate(ptr, 1) or deallocate_bulk()
+    void allocate_bulk(size_t n, T **out) {
+        pool_->allocate_bulk(n, out);
+    }
+
+    void deallocate_bulk(T *const *ptrs, size_t n) {
+        pool_->deallocate_bulk(ptrs, n);
+    }
+
+    // Make room for n objects of T now, see PoolAllocator::reserve()
+    void reserve(size_t n, bool prefault = false) {
+        pool_->reserve((n + kChunksPerBlock - 1) / kChunksPerBlock, prefault);
+    }
+
+    // Shared by all copies and rebound copies, like the pools
+    void set_stats(AllocatorStats *stats) {
+        registry_->set_stats(stats);
+    }
+
+    AllocatorStats* stats() const {
+        return registry_->stats();
+    }
+
+    template <typename U>
+    bool operator==(const ConcurrentPoolAllocator<U, BlockSize, MagazineSize, Alignment>& other) const {
+        return registry_ == other.registry_;
+    }
+
+    template <typename U>
+    bool operator!=(const ConcurrentPoolAllocator<U, BlockSize, MagazineSize, Alignment>& other) const {
+        return registry_ != other.registry_;
+    }
+
+private:
+    // Same rounding as PoolAllocator: array classes are aligned to their size,
+    // so an array takes at least a class of kAlignment bytes
+    static size_t array_size(size_t n) {
+        const auto bytes = std::max(sizeof(T) * n, kAlignment);
+        return (bytes + kAlignment - 1) & ~(kAlignment - 1);
+    }
+};
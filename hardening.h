@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#endif
+
+/* Hardened mode, compiled in with -DALLOCATOR_HARDENED (see `make hardened`)
+   and out of release builds entirely: every hook below is an empty inline
+   function unless it is set.
+
+   - Pool and ConcurrentPool fill freed chunks with kFreePattern and check it on
+     the next allocation, so a write through a dangling pointer aborts instead
+     of corrupting whoever gets the chunk next.
+   - Pool marks free chunks with a canary derived from their address, which is
+     how it tells a double free from a first one.
+   - THPAllocator and CacheAlignedAllocator put an inaccessible guard page in
+     front of and behind their buffers (only those of at least a page for
+     CacheAlignedAllocator).
+   - Under AddressSanitizer, free chunks are also poisoned, so ASan reports
+     the bad access itself instead of the allocator noticing it later. */
+namespace hardening {
+
+#if defined(ALLOCATOR_HARDENED)
+constexpr bool kEnabled = true;
+#else
+constexpr bool kEnabled = false;
+#endif
+
+constexpr uint8_t kFreePattern = 0xdf;
+constexpr uintptr_t kFreeCanary = 0x5eed'f4ee'c4a4'1e55;
+
+[[noreturn]] inline void fail(const char *what, const void *ptr) {
+    fprintf(stderr, "allocator: %s at %p\n", what, ptr);
+    abort();
+}
+
+inline void poison(const void *ptr, size_t size) {
+#if defined(__SANITIZE_ADDRESS__)
+    ASAN_POISON_MEMORY_REGION(ptr, size);
+#else
+    (void) ptr;
+    (void) size;
+#endif
+}
+
+inline void unpoison(const void *ptr, size_t size) {
+#if defined(__SANITIZE_ADDRESS__)
+    ASAN_UNPOISON_MEMORY_REGION(ptr, size);
+#else
+    (void) ptr;
+    (void) size;
+#endif
+}
+
+// Fill [ptr + offset, ptr + size) of a freed chunk with the pattern and poison it
+inline void fill_freed(void *ptr, size_t size, size_t offset = 0) {
+    if constexpr (kEnabled) {
+        if (size > offset) {
+            unpoison(static_cast<uint8_t *>(ptr) + offset, size - offset);
+            memset(static_cast<uint8_t *>(ptr) + offset, kFreePattern, size - offset);
+            poison(static_cast<uint8_t *>(ptr) + offset, size - offset);
+        }
+    }
+}
+
+// Check that nobody wrote to a free chunk since fill_freed(), before handing it out
+inline void check_freed(void *ptr, size_t size, size_t offset = 0) {
+    if constexpr (kEnabled) {
+        if (size > offset) {
+            auto begin = static_cast<uint8_t *>(ptr) + offset;
+            unpoison(begin, size - offset);
+            for (size_t i = 0; i < size - offset; i++) {
+                if (begin[i] != kFreePattern) {
+                    fail("free chunk was written to (use after free)", ptr);
+                }
+            }
+        }
+    }
+}
+
+// The canary of a free chunk, unlikely to be found in a live object
+inline uintptr_t free_canary(const void *ptr) {
+    return kFreeCanary ^ reinterpret_cast<uintptr_t>(ptr);
+}
+
+inline size_t page_size() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/* Map size bytes aligned to alignment between two PROT_NONE guard pages, so
+   running off either end of the buffer faults right away. With an alignment
+   of at most a page, the buffer is placed at the end of its pages to catch
+   overflows by as little as the alignment. Larger alignments start it on a
+   page instead, which catches underflows exactly. */
+inline void* map_guarded(size_t size, size_t alignment) {
+    const auto page = page_size();
+    const auto length = (size + page - 1) & ~(page - 1);
+    const auto extra = alignment > page ? alignment - page : 0;
+    const auto map_size = length + 2 * page + extra;
+
+    auto raw = mmap(nullptr, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+
+    // The first page of the buffer, trimming the extra of a large alignment
+    auto start = reinterpret_cast<uintptr_t>(raw);
+    auto data = start + page;
+    if (alignment > page) {
+        data = (data + alignment - 1) & ~(uintptr_t{alignment} - 1);
+        if (data - page != start) {
+            munmap(raw, data - page - start);
+        }
+        auto end = data + length + page;
+        if (end != start + map_size) {
+            munmap(reinterpret_cast<void *>(end), start + map_size - end);
+        }
+    }
+
+    if (mprotect(reinterpret_cast<void *>(data), length, PROT_READ | PROT_WRITE) != 0) {
+        munmap(reinterpret_cast<void *>(data - page), length + 2 * page);
+        throw std::bad_alloc();
+    }
+
+    if (alignment <= page) {
+        const auto aligned_size = (size + alignment - 1) & ~(alignment - 1);
+        data += length - aligned_size;
+    }
+    return reinterpret_cast<void *>(data);
+}
+
+inline void unmap_guarded(void *ptr, size_t size) {
+    const auto page = page_size();
+    const auto length = (size + page - 1) & ~(page - 1);
+    const auto first_page = reinterpret_cast<uintptr_t>(ptr) & ~(uintptr_t{page} - 1);
+    munmap(reinterpret_cast<void *>(first_page - page), length + 2 * page);
+}
+
+} // namespace hardening
@@ -1,85 +1,127 @@
-#include <cstdlib>
-#include <limits>
-#include <iostream>
+#include <string>
 #include <vector>
-#include <new>
-#include <chrono>
-#include <sys/mman.h>
-
-template <typename T, size_t HugePageSize = 1 << 21> 
-class THPAllocator {
-public:
-    using is_always_equal = std::true_type;
-    using value_type = T;
-
-    template <typename U>
-    struct rebind {
-        using other = THPAllocator<U, HugePageSize>;
-    };
-
-    THPAllocator() = default;
-
-    template <class U>
-    constexpr THPAllocator(const THPAllocator<U>& other) {
-        (void) other;
-    }
+#include "benchmark_util.h"
+#include "huge_page_allocator.h"
 
-    T *allocate(size_t n) {
-        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
-            throw std::bad_alloc();
-        }
-        const auto total_size = n * sizeof(T);
-        void *p = nullptr;
-        if (posix_memalign(&p, HugePageSize, total_size) != 0) {
-            throw std::bad_alloc();
-        }
+// BENCHMARK CODE
 
-        madvise(p, total_size, MADV_HUGEPAGE);
-        if (p == nullptr) {
-            throw std::bad_alloc();
+namespace {
+
+// We allocate 8 MB worth of integers
+constexpr const int kNumElems = (1 << 23) / sizeof(int);
+
+template <typename Allocator>
+void BM_VectorGrowth(benchmark::State& state) {
+    for (auto _ : state) {
+        std::vector<int, Allocator> l;
+        for (int i = 0; i < kNumElems; i++) {
+            l.emplace_back(i);
         }
+        benchmark::DoNotOptimize(l.data());
+    }
 
-        return static_cast<T *>(p);
+    set_operations(state, kNumElems);
+}
+
+// Capacity is reserved up front, as a service would at startup, so only
+// first-touch page faults can land in the timed region
+template <typename Allocator>
+void BM_VectorReserved(benchmark::State& state) {
+    for (auto _ : state) {
+        std::vector<int, Allocator> l;
+        l.reserve(kNumElems);
+        for (int i = 0; i < kNumElems; i++) {
+            l.emplace_back(i);
+        }
+        benchmark::DoNotOptimize(l.data());
     }
 
-    void deallocate(T *p, size_t n) { 
-        (void) n;
-        free(p); 
+    set_operations(state, kNumElems);
+}
+
+// Whether the MAP_HUGETLB reservation or one of its fallbacks was used
+template <typename Allocator>
+void BM_VectorGrowthBacking(benchmark::State& state) {
+    BM_VectorGrowth<Allocator>(state);
+    state.SetLabel(to_string(Allocator::last_backing()));
+}
+
+// The same growth with mremap() instead of copying on every reallocation
+template <typename Buffer>
+void BM_BufferGrowth(benchmark::State& state) {
+    PageBacking backing = PageBacking::BasePages;
+    for (auto _ : state) {
+        Buffer l;
+        for (int i = 0; i < kNumElems; i++) {
+            l.emplace_back(i);
+        }
+        benchmark::DoNotOptimize(l.data());
+        backing = l.backing();
     }
+
+    set_operations(state, kNumElems);
+    state.SetLabel(to_string(backing));
+}
+
+// Address space for all kNumElems reserved up front, so the buffer never moves
+struct ReservedBuffer : HugePageBuffer<int> {
+    ReservedBuffer() : HugePageBuffer<int>(0, kNumElems) {}
 };
 
+// A large cache, scanned from the node it was placed on by the Numa policy
+template <typename Allocator>
+void BM_TierScan(benchmark::State& state) {
+    constexpr const size_t kCacheElems = (size_t{1} << 26) / sizeof(int);
+    std::vector<int, Allocator> cache(kCacheElems, 1);
 
-// BENCHMARK CODE
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (auto value : cache) {
+            sum += value;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    set_operations(state, kCacheElems);
+    state.SetLabel("node " + std::to_string(numa_node_of(cache.data())));
+}
 
-template <typename T, typename Allocator = std::allocator<T>>
-int64_t run_benchmark() {
-    // We allocate 8 MB worth of integers
-    constexpr const int kNumElems = (1 << 23) / sizeof(int);
-    std::vector<int, Allocator> l;
+// Demoting the cache to the far tier and promoting it back with move_pages()
+void BM_TierMigrate(benchmark::State& state) {
+    constexpr const size_t kCacheElems = (size_t{1} << 26) / sizeof(int);
+    using Allocator = THPAllocator<int>;
+    std::vector<int, Allocator> cache(kCacheElems, 1);
 
-    auto start = std::chrono::steady_clock::now();
-    for (int i = 0; i < kNumElems; i++) {
-        l.emplace_back(i);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Allocator::migrate(cache.data(), cache.size(), MemoryTier::Cold));
+        benchmark::DoNotOptimize(Allocator::migrate(cache.data(), cache.size(), MemoryTier::Hot));
     }
 
-    auto stop = std::chrono::steady_clock::now();
-    return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    state.SetBytesProcessed(2 * state.iterations() * kCacheElems * sizeof(int));
+    state.SetLabel(numa_far_nodes().none() ? "no far tier"
+                                           : "far node " + std::to_string(numa_tier_node(MemoryTier::Cold)));
 }
- 
 
-int main() {
+using HugeTLBAllocator = THPAllocator<int, 1 << 21, HugePageMode::HugeTLB>;
+using PopulatingAllocator = THPAllocator<int, 1 << 21, HugePageMode::Madvise, Prefault::Populate>;
+using LocalAllocator = THPAllocator<int, 1 << 21, HugePageMode::Madvise, Prefault::None, NumaLocal>;
 
-    constexpr int iterations = 100;
-    int64_t std_alloc_mean = 0;
-    int64_t custom_alloc_mean = 0;
+} // namespace
 
-    for (int i = 0; i < iterations; i++) {
-        std_alloc_mean += run_benchmark<int>();
-        custom_alloc_mean += run_benchmark<int, THPAllocator<int>>();
-    }
+BENCHMARK_TEMPLATE(BM_VectorGrowth, std::allocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_VectorGrowth, THPAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_VectorGrowthBacking, HugeTLBAllocator)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_VectorGrowth, LocalAllocator)->Apply(configure);
+
+BENCHMARK_TEMPLATE(BM_BufferGrowth, HugePageBuffer<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_BufferGrowth, HugePageBuffer<int, 1 << 21, HugePageMode::HugeTLB>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_BufferGrowth, ReservedBuffer)->Apply(configure);
 
-    std::cout << "std::allocator mean: " << std_alloc_mean / iterations << " μs\n";
-    std::cout << "THPAllocator   mean: " << custom_alloc_mean / iterations << " μs\n";
+BENCHMARK_TEMPLATE(BM_VectorReserved, std::allocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_VectorReserved, THPAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_VectorReserved, PopulatingAllocator)->Apply(configure);
 
-    return 0;
-}
\ No newline at end of file
+BENCHMARK_TEMPLATE(BM_TierScan, THPAllocator<int, 1 << 21, HugePageMode::Madvise, Prefault::None, NumaHot>)
+    ->Apply(configure);
+BENCHMARK_TEMPLATE(BM_TierScan, ColdTHPAllocator<int>)->Apply(configure);
+BENCHMARK(BM_TierMigrate)->Apply(configure);
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <new>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "numa_policy.h"
+#include "page_backing.h"
+#include "hardening.h"
+#include "allocation_profiler.h"
+
+enum class Prefault {
+    // Pages are faulted in on first touch
+    None,
+    // allocate() faults in the whole range before returning
+    Populate,
+    // Same, with the range split across hardware_concurrency() threads
+    ParallelPopulate,
+};
+
+template <typename T, size_t HugePageSize = 1 << 21, HugePageMode Mode = HugePageMode::Madvise,
+          Prefault Populate = Prefault::None, typename Numa = NumaDefault>
+class THPAllocator {
+    static_assert((HugePageSize & (HugePageSize - 1)) == 0, "HugePageSize must be a power of two");
+
+public:
+    using is_always_equal = std::true_type;
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = THPAllocator<U, HugePageSize, Mode, Populate, Numa>;
+    };
+
+    THPAllocator() = default;
+
+    template <class U>
+    constexpr THPAllocator(const THPAllocator<U, HugePageSize, Mode, Populate, Numa>& other) {
+        (void) other;
+    }
+
+    T *allocate(size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        const auto total_size = n * sizeof(T);
+        profile_allocation(total_size);
+        void *p = nullptr;
+        if constexpr (Mode == HugePageMode::HugeTLB) {
+            p = map_huge_pages(total_size);
+            populate(p, total_size);
+            return static_cast<T *>(p);
+        }
+
+        // Hardened builds map the buffer between guard pages (HugeTLB mappings
+        // cannot have any, their pages are all huge)
+        if constexpr (hardening::kEnabled) {
+            p = hardening::map_guarded(total_size, HugePageSize);
+        } else if (posix_memalign(&p, HugePageSize, total_size) != 0) {
+            throw std::bad_alloc();
+        }
+
+        madvise(p, total_size, MADV_HUGEPAGE);
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        Numa::apply(p, total_size);
+        last_backing_ = thp_enabled() ? PageBacking::THP : PageBacking::BasePages;
+        populate(p, total_size);
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, size_t n) { 
+        if constexpr (Mode == HugePageMode::HugeTLB) {
+            munmap(p, round_up(n * sizeof(T)));
+            return;
+        }
+
+        if constexpr (hardening::kEnabled) {
+            hardening::unmap_guarded(p, n * sizeof(T));
+            return;
+        }
+
+        (void) n;
+        free(p); 
+    }
+
+    /* Move n objects at p, allocated from any THPAllocator, to the node of a
+       memory tier as seen from the calling thread (see numa_tier_node()), e.g.
+       a large cache gone cold to the CXL or PMEM node, and back once it heats
+       up. The range prefers that node from now on, so pages faulted in later
+       follow. Returns how many pages are on the node afterwards. */
+    static size_t migrate(T *p, size_t n, MemoryTier tier) {
+        static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+        const auto node = numa_tier_node(tier);
+        const auto begin = reinterpret_cast<uintptr_t>(p) & ~(kPageSize - 1);
+        const auto end = (reinterpret_cast<uintptr_t>(p + n) + kPageSize - 1) & ~(kPageSize - 1);
+
+        numa_prefer_node(reinterpret_cast<void *>(begin), end - begin, node);
+        return numa_move_pages(reinterpret_cast<void *>(begin), end - begin, node);
+    }
+
+    // What backed the calling thread's most recent allocate(). For THP this is
+    // what was requested, khugepaged may still collapse the range later.
+    static PageBacking last_backing() {
+        return last_backing_;
+    }
+
+private:
+    static inline thread_local PageBacking last_backing_ = PageBacking::BasePages;
+
+    // Runs after madvise(MADV_HUGEPAGE) and the NUMA policy, so the faults
+    // allocate huge pages on the right node
+    static void populate(void *p, size_t size) {
+        if constexpr (Populate == Prefault::Populate) {
+            prefault(p, size);
+        } else if constexpr (Populate == Prefault::ParallelPopulate) {
+            prefault(p, size, std::thread::hardware_concurrency());
+        }
+    }
+
+    static size_t round_up(size_t size) {
+        return (size + HugePageSize - 1) & ~(HugePageSize - 1);
+    }
+
+    static void* map_huge_pages(size_t size) {
+        const auto length = round_up(size);
+        void *p = HugePages<HugePageSize, HugePageMode::HugeTLB>::map(length, HugePageSize, last_backing_);
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        Numa::apply(p, length);
+        return p;
+    }
+};
+
+// Huge pages for data that is rarely touched, placed on the far memory tier
+template <typename T>
+using ColdTHPAllocator = THPAllocator<T, 1 << 21, HugePageMode::Madvise, Prefault::None, NumaCold>;
+
+/* Growable array in its own huge-page mapping. std::vector can only grow by
+   allocating a new buffer and copying into it, which for a huge buffer costs a
+   memcpy of everything so far and a fresh round of page faults. This grows
+   with mremap() instead: in place if the address space after the mapping is
+   free, otherwise by moving the page tables to a new huge-page-aligned range,
+   so no data is copied either way. Only kernels that cannot remap hugetlbfs
+   mappings fall back to copying.
+
+   Elements are relocated bytewise, hence the restriction to trivially
+   copyable types. Numa applies to every newly mapped part of the buffer.
+
+   Given a max_capacity, the buffer reserves the address space for it up front
+   and only commits it as it grows, so it never moves at all: pointers into it
+   stay valid, and growing past max_capacity throws std::bad_alloc. */
+template <typename T, size_t HugePageSize = 1 << 21, HugePageMode Mode = HugePageMode::Madvise,
+          typename Numa = NumaDefault>
+class HugePageBuffer {
+    static_assert(std::is_trivially_copyable_v<T>, "HugePageBuffer moves its elements with mremap()");
+
+private:
+    using Mapping = HugePages<HugePageSize, Mode>;
+
+    T *data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    size_t mapped_ = 0;
+    PageBacking backing_ = PageBacking::BasePages;
+    AddressReservation<Mapping> reservation_;
+
+public:
+    using value_type = T;
+    using iterator = T *;
+    using const_iterator = const T *;
+
+    HugePageBuffer() = default;
+
+    explicit HugePageBuffer(size_t capacity) {
+        reserve(capacity);
+    }
+
+    HugePageBuffer(size_t capacity, size_t max_capacity) : reservation_(checked_size(max_capacity)) {
+        data_ = reinterpret_cast<T *>(reservation_.base());
+        reserve(capacity);
+    }
+
+    HugePageBuffer(const HugePageBuffer&) = delete;
+    HugePageBuffer& operator=(const HugePageBuffer&) = delete;
+
+    HugePageBuffer(HugePageBuffer&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)),
+          capacity_(std::exchange(other.capacity_, 0)), mapped_(std::exchange(other.mapped_, 0)),
+          backing_(other.backing_), reservation_(std::move(other.reservation_)) {}
+
+    HugePageBuffer& operator=(HugePageBuffer&& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(mapped_, other.mapped_);
+        std::swap(backing_, other.backing_);
+        std::swap(reservation_, other.reservation_);
+        return *this;
+    }
+
+    ~HugePageBuffer() {
+        if (data_ != nullptr && reservation_.size() == 0) {
+            munmap(data_, mapped_);
+        }
+    }
+
+    void reserve(size_t n) {
+        if (n > capacity_) {
+            grow(checked_size(n));
+        }
+    }
+
+    // New elements are value-initialized
+    void resize(size_t n) {
+        reserve(n);
+        if (n > size_) {
+            std::uninitialized_value_construct(data_ + size_, data_ + n);
+        }
+        size_ = n;
+    }
+
+    void push_back(const T& value) {
+        emplace_back(value);
+    }
+
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        if (size_ != capacity_) {
+            return *new (&data_[size_++]) T(std::forward<Args>(args)...);
+        }
+        // The arguments may refer to an element, and growing can move the mapping
+        T value(std::forward<Args>(args)...);
+        auto bytes = std::max(2 * mapped_, round_up(sizeof(T)));
+        if (reservation_.size() != 0) {
+            bytes = std::min(bytes, reservation_.size());
+        }
+        grow(bytes);
+        return *new (&data_[size_++]) T(std::move(value));
+    }
+
+    void pop_back() {
+        size_--;
+    }
+
+    // Keeps the mapping
+    void clear() {
+        size_ = 0;
+    }
+
+    T& operator[](size_t i) {
+        return data_[i];
+    }
+
+    const T& operator[](size_t i) const {
+        return data_[i];
+    }
+
+    T* data() {
+        return data_;
+    }
+
+    const T* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    iterator begin() { return data_; }
+    iterator end() { return data_ + size_; }
+    const_iterator begin() const { return data_; }
+    const_iterator end() const { return data_ + size_; }
+
+    // What backs the buffer, moving a mapping keeps its backing
+    PageBacking backing() const {
+        return backing_;
+    }
+
+private:
+    static size_t round_up(size_t size) {
+        return (size + HugePageSize - 1) & ~(HugePageSize - 1);
+    }
+
+    // Bytes of whole huge pages for n elements
+    static size_t checked_size(size_t n) {
+        if (n > (std::numeric_limits<size_t>::max() - HugePageSize) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        return round_up(n * sizeof(T));
+    }
+
+    // bytes is a multiple of HugePageSize
+    void grow(size_t bytes) {
+        if (reservation_.size() != 0) {
+            // Commit the next part of the reservation, right after the last one
+            if (bytes <= mapped_ || reservation_.commit(bytes - mapped_, HugePageSize, backing_) == nullptr) {
+                throw std::bad_alloc();
+            }
+        } else if (data_ == nullptr) {
+            data_ = static_cast<T *>(Mapping::map(bytes, HugePageSize, backing_));
+            if (data_ == nullptr) {
+                throw std::bad_alloc();
+            }
+        } else if (auto p = mremap(data_, mapped_, bytes, 0); p != MAP_FAILED) {
+            // Extended in place, the new part inherits the madvise() flags
+        } else {
+            // Reserve an aligned range and move the mapping over it, replacing it
+            // as a whole: the pages move along with their page tables
+            PageBacking target_backing;
+            auto target = Mapping::map(bytes, HugePageSize, target_backing);
+            if (target == nullptr) {
+                throw std::bad_alloc();
+            }
+
+            if (mremap(data_, mapped_, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, target) == MAP_FAILED) {
+                memcpy(target, data_, size_ * sizeof(T));
+                munmap(data_, mapped_);
+                backing_ = target_backing;
+            }
+            data_ = static_cast<T *>(target);
+        }
+
+        Numa::apply(reinterpret_cast<uint8_t *>(data_) + mapped_, bytes - mapped_);
+        profile_allocation(bytes - mapped_);
+        mapped_ = bytes;
+        capacity_ = bytes / sizeof(T);
+    }
+};
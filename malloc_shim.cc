@@ -0,0 +1,508 @@
+/* A malloc replacement for unmodified binaries, built as libpool_malloc.so:
+
+       LD_PRELOAD=./libpool_malloc.so ./some_binary
+
+   Requests of up to SizeClassPool::kMaxSize bytes are served by size-class
+   pools of the calling thread (ThreadOwned, so any thread may free to them),
+   ones of at least $POOL_MALLOC_HUGE_SIZE bytes (1 MiB by default, 0 turns it
+   off) by THPAllocator, and everything in between by glibc, which also takes
+   over for threads beyond the kMaxThreads that have pools.
+   POOL_MALLOC_BACKEND=glibc forwards everything to glibc, to measure the
+   shim itself.
+
+   All pools commit their regions from one address range reserved at startup,
+   so free() tells their chunks from glibc's (and THPAllocator's, which come
+   from posix_memalign) with a range check. Whatever the shim allocates for
+   itself, e.g. the Pool objects and their bookkeeping, goes straight to glibc:
+   a thread-local flag catches the recursion. */
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <bitset>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <dlfcn.h>
+#include <unistd.h>
+#include "page_backing.h"
+#include "pool_allocator.h"
+#include "size_class_allocator.h"
+#include "huge_page_allocator.h"
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void __libc_free(void *ptr);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+}
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+namespace {
+
+using Classes = SizeClassPool<>;
+
+constexpr size_t kMaxThreads = 256;
+constexpr size_t kReserveSize = size_t{1} << 36;
+
+enum class Backend {
+    Pool,
+    Glibc,
+};
+
+struct Config {
+    Backend backend = Backend::Pool;
+    size_t huge_size = 1 << 20;
+    size_t (*glibc_usable_size)(void *) = nullptr;
+};
+
+// Set while the shim runs on this thread, so its own allocations go to glibc
+thread_local bool tls_in_shim = false;
+
+class ShimScope {
+public:
+    ShimScope() { tls_in_shim = true; }
+    ~ShimScope() { tls_in_shim = false; }
+};
+
+// Read on the first call, which may come from the dynamic loader before any
+// constructor ran, so nothing in here may allocate through the shim
+const Config& config() {
+    static const Config config = [] {
+        ShimScope scope;
+        Config c;
+        if (auto env = getenv("POOL_MALLOC_BACKEND")) {
+            c.backend = strcmp(env, "glibc") == 0 ? Backend::Glibc : Backend::Pool;
+        }
+        if (auto env = getenv("POOL_MALLOC_HUGE_SIZE")) {
+            c.huge_size = strtoull(env, nullptr, 0);
+        }
+        c.glibc_usable_size = reinterpret_cast<size_t (*)(void *)>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+        return c;
+    }();
+    return config;
+}
+
+/* Pool backing committing every region from the one reservation. Pools are
+   never destroyed (chunks of an exited thread's pools may still be live), so
+   nothing is ever unmapped. */
+class ShimPages {
+private:
+    static inline std::atomic<uintptr_t> begin_{0};
+    static inline std::atomic<uintptr_t> end_{0};
+
+    static AddressReservation<BasePages>& reservation() {
+        alignas(AddressReservation<BasePages>) static uint8_t storage[sizeof(AddressReservation<BasePages>)];
+        static auto reservation = [] {
+            auto r = new (storage) AddressReservation<BasePages>(kReserveSize);
+            begin_.store(reinterpret_cast<uintptr_t>(r->base()), std::memory_order_relaxed);
+            end_.store(reinterpret_cast<uintptr_t>(r->base()) + r->size(), std::memory_order_relaxed);
+            return r;
+        }();
+        return *reservation;
+    }
+
+    static std::mutex& mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+public:
+    static constexpr bool kContiguous = false;
+
+    static size_t page_size() {
+        return BasePages::page_size();
+    }
+
+    static void* map(size_t size, size_t alignment, PageBacking& backing) {
+        void *region;
+        {
+            std::scoped_lock<std::mutex> lock(mutex());
+            region = reservation().commit(size, alignment, backing);
+        }
+
+        // Pool finds a block's header by masking chunk addresses down to the
+        // block, a misaligned block would corrupt the heap of the whole process
+        if (region != nullptr && reinterpret_cast<uintptr_t>(region) % alignment != 0) {
+            static const char kMessage[] = "libpool_malloc: misaligned pool block\n";
+            (void) !write(STDERR_FILENO, kMessage, sizeof(kMessage) - 1);
+            abort();
+        }
+        return region;
+    }
+
+    static void unmap(void *p, size_t size) {
+        (void) p;
+        (void) size;
+    }
+
+    static void release(void *p, size_t size) {
+        BasePages::release(p, size);
+    }
+
+    // Whether ptr is a pool chunk, false for everything before the first pool
+    static bool contains(const void *ptr) {
+        auto address = reinterpret_cast<uintptr_t>(ptr);
+        return address >= begin_.load(std::memory_order_relaxed) && address < end_.load(std::memory_order_relaxed);
+    }
+};
+
+using PoolType = Pool<1 << 16, 0, alignof(void *), ShimPages, true>;
+
+/* The pools of thread slot i. Unlike ThreadSlots, a thread gives its slot
+   back only after making the pools ownerless, so frees it still does while
+   exiting (after its thread_local destructors) are remote frees, and never
+   race with the thread that takes the slot over next. */
+struct ThreadPools {
+    PoolType *pools[Classes::kNumClasses];
+};
+
+ThreadPools thread_pools[kMaxThreads];
+std::bitset<kMaxThreads> used_slots;
+std::mutex slots_mutex;
+
+constexpr int kNoSlot = -1;
+constexpr int kExited = -2;
+thread_local int tls_slot = kNoSlot;
+
+void release_slot() {
+    if (tls_slot < 0) {
+        return;
+    }
+
+    for (auto pool : thread_pools[tls_slot].pools) {
+        if (pool != nullptr) {
+            pool->set_owner(std::thread::id());
+        }
+    }
+
+    std::scoped_lock<std::mutex> lock(slots_mutex);
+    used_slots[tls_slot] = false;
+    tls_slot = kExited;
+}
+
+struct SlotReleaser {
+    ~SlotReleaser() {
+        ShimScope scope;
+        release_slot();
+    }
+};
+
+thread_local SlotReleaser tls_releaser;
+
+// The slot of the calling thread, or kNoSlot if it gets none
+int thread_slot() {
+    if (tls_slot != kNoSlot) {
+        return tls_slot >= 0 ? tls_slot : kNoSlot;
+    }
+
+    {
+        std::scoped_lock<std::mutex> lock(slots_mutex);
+        for (size_t i = 0; i < kMaxThreads; i++) {
+            if (!used_slots[i]) {
+                used_slots[i] = true;
+                tls_slot = i;
+                break;
+            }
+        }
+    }
+    if (tls_slot < 0) {
+        tls_slot = kExited;
+        return kNoSlot;
+    }
+
+    // Registers the destructor, take over the pools of the previous owner
+    (void) &tls_releaser;
+    for (auto pool : thread_pools[tls_slot].pools) {
+        if (pool != nullptr) {
+            pool->set_owner(std::this_thread::get_id());
+        }
+    }
+    return tls_slot;
+}
+
+// glibc's malloc aligns to alignof(std::max_align_t), memalign to anything
+void* libc_allocate(size_t size, size_t alignment) {
+    return alignment > alignof(std::max_align_t) ? __libc_memalign(alignment, size) : __libc_malloc(size);
+}
+
+// A chunk of the class of max(size, alignment). Must be called in a ShimScope.
+void* allocate_small(size_t size, size_t alignment = 0) {
+    const int slot = thread_slot();
+    if (slot == kNoSlot) {
+        return libc_allocate(size, alignment);
+    }
+
+    const auto index = Classes::class_index(std::max(size, alignment));
+    auto& pool = thread_pools[slot].pools[index];
+    try {
+        if (pool == nullptr) {
+            pool = new PoolType(Classes::class_size(index));
+        }
+        return pool->allocate();
+    } catch (const std::bad_alloc&) {
+        return libc_allocate(size, alignment);
+    }
+}
+
+void* allocate_huge(size_t size) {
+    try {
+        return THPAllocator<uint8_t>().allocate(size);
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+bool use_pools() {
+    return !tls_in_shim && config().backend == Backend::Pool;
+}
+
+bool is_huge(size_t size) {
+    return config().huge_size != 0 && size >= config().huge_size;
+}
+
+void* shim_malloc(size_t size) {
+    if (!use_pools()) {
+        return __libc_malloc(size);
+    }
+
+    ShimScope scope;
+    if (size <= Classes::kMaxSize) {
+        return allocate_small(size);
+    }
+    if (is_huge(size)) {
+        return allocate_huge(size);
+    }
+    return __libc_malloc(size);
+}
+
+void shim_free(void *ptr) {
+    if (ShimPages::contains(ptr)) {
+        ShimScope scope;
+        PoolType::owner(ptr)->deallocate(ptr);
+        return;
+    }
+    __libc_free(ptr);
+}
+
+size_t usable_size(void *ptr) {
+    if (ptr == nullptr) {
+        return 0;
+    }
+    if (ShimPages::contains(ptr)) {
+        return PoolType::owner(ptr)->chunk_size();
+    }
+    return config().glibc_usable_size != nullptr ? config().glibc_usable_size(ptr) : 0;
+}
+
+// Size classes are powers of two in aligned blocks, so each chunk is aligned
+// to its class size, and huge allocations to a huge page
+void* shim_memalign(size_t alignment, size_t size) {
+    if (!use_pools() || (alignment & (alignment - 1)) != 0) {
+        return __libc_memalign(alignment, size);
+    }
+
+    ShimScope scope;
+    if (std::max(size, alignment) <= Classes::kMaxSize) {
+        return allocate_small(size, alignment);
+    }
+    if (is_huge(size) && alignment <= (1 << 21)) {
+        return allocate_huge(size);
+    }
+    return __libc_memalign(alignment, size);
+}
+
+void* shim_realloc(void *ptr, size_t size) {
+    if (ptr == nullptr) {
+        return shim_malloc(size);
+    }
+    if (size == 0) {
+        shim_free(ptr);
+        return nullptr;
+    }
+
+    const bool pooled = ShimPages::contains(ptr);
+    if (!pooled && (!use_pools() || (size > Classes::kMaxSize && !is_huge(size)))) {
+        return __libc_realloc(ptr, size);
+    }
+
+    // Still fits, and wastes at most half of the chunk
+    const auto old_size = usable_size(ptr);
+    if (pooled && size <= old_size && (size > old_size / 2 || old_size == Classes::kMinSize)) {
+        return ptr;
+    }
+
+    auto new_ptr = shim_malloc(size);
+    if (new_ptr != nullptr) {
+        memcpy(new_ptr, ptr, std::min(old_size, size));
+        shim_free(ptr);
+    }
+    return new_ptr;
+}
+
+void* new_or_throw(size_t size, size_t alignment = 0) {
+    for (;;) {
+        auto ptr = alignment != 0 ? shim_memalign(alignment, size) : shim_malloc(size);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+
+        auto handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+SHIM_EXPORT void* malloc(size_t size) {
+    return shim_malloc(size);
+}
+
+SHIM_EXPORT void free(void *ptr) {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void* calloc(size_t n, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(n, size, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    // Above the size classes glibc clears only what it recycles, fresh mmap()ed
+    // memory is already zero. THPAllocator's posix_memalign() does not say
+    // which one it returned, so huge requests lose the huge page hint instead
+    // of dirtying every page.
+    if (!use_pools() || bytes > Classes::kMaxSize) {
+        return __libc_calloc(n, size);
+    }
+
+    // Pool chunks are recycled
+    auto ptr = shim_malloc(bytes);
+    if (ptr != nullptr) {
+        memset(ptr, 0, bytes);
+    }
+    return ptr;
+}
+
+SHIM_EXPORT void* realloc(void *ptr, size_t size) {
+    return shim_realloc(ptr, size);
+}
+
+SHIM_EXPORT void* memalign(size_t alignment, size_t size) {
+    return shim_memalign(alignment, size);
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    return shim_memalign(alignment, size);
+}
+
+SHIM_EXPORT int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    auto ptr = shim_memalign(alignment, size);
+    if (ptr == nullptr) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+SHIM_EXPORT void* valloc(size_t size) {
+    return __libc_valloc(size);
+}
+
+SHIM_EXPORT void* pvalloc(size_t size) {
+    return __libc_pvalloc(size);
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void *ptr) {
+    return usable_size(ptr);
+}
+
+} // extern "C"
+
+SHIM_EXPORT void* operator new(size_t size) {
+    return new_or_throw(size);
+}
+
+SHIM_EXPORT void* operator new[](size_t size) {
+    return new_or_throw(size);
+}
+
+SHIM_EXPORT void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return shim_malloc(size);
+}
+
+SHIM_EXPORT void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return shim_malloc(size);
+}
+
+SHIM_EXPORT void* operator new(size_t size, std::align_val_t alignment) {
+    return new_or_throw(size, static_cast<size_t>(alignment));
+}
+
+SHIM_EXPORT void* operator new[](size_t size, std::align_val_t alignment) {
+    return new_or_throw(size, static_cast<size_t>(alignment));
+}
+
+SHIM_EXPORT void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return shim_memalign(static_cast<size_t>(alignment), size);
+}
+
+SHIM_EXPORT void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return shim_memalign(static_cast<size_t>(alignment), size);
+}
+
+SHIM_EXPORT void operator delete(void *ptr) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, size_t) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, size_t) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, const std::nothrow_t&) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, std::align_val_t) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, std::align_val_t) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    shim_free(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+    shim_free(ptr);
+}
@@ -0,0 +1,51 @@
+#include <list>
+#include <vector>
+#include <string>
+#include <memory_resource>
+#include "benchmark_util.h"
+#include "memory_resources.h"
+
+// BENCHMARK CODE
+
+namespace {
+
+// The container type is the same for every resource, only the resource passed
+// at runtime changes
+void BM_PmrContainers(benchmark::State& state, const std::string& name) {
+    constexpr const int kNumElems = 1000000;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto resource = make_memory_resource(name);
+        state.ResumeTiming();
+        {
+            std::pmr::list<int> l(resource.get());
+            std::pmr::vector<std::pmr::vector<int>> vectors(resource.get());
+            for (int i = 0; i < kNumElems; i++) {
+                l.emplace_back(i);
+                if (i % 100 == 0) {
+                    vectors.emplace_back(i % 64, i);
+                }
+            }
+
+            state.PauseTiming();
+        }
+        resource.reset();
+        state.ResumeTiming();
+    }
+
+    set_operations(state, kNumElems);
+}
+
+// A bare "huge_page" resource is left out, it would map a huge page for every
+// list node. Use --benchmark_filter to run a subset.
+const bool registered = [] {
+    for (const char *name : {"new_delete", "aligned", "pool", "arena", "pool+huge_page", "arena+huge_page"}) {
+        benchmark::RegisterBenchmark((std::string("BM_PmrContainers/") + name).c_str(),
+                                     BM_PmrContainers, std::string(name))
+            ->Apply(configure);
+    }
+    return true;
+}();
+
+} // namespace
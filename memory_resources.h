@@ -0,0 +1,224 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <algorithm>
+#include "size_class_allocator.h"
+#include "cache_aligned_allocator.h"
+#include "huge_page_allocator.h"
+#include "arena_allocator.h"
+
+/* std::pmr::memory_resource adapters for the allocators, so the allocation
+   strategy of a std::pmr container can be chosen at runtime and resources can
+   be stacked on top of each other. None of them are thread safe beyond what the
+   underlying allocator provides, like std::pmr::unsynchronized_pool_resource. */
+
+// Small requests are served by a SizeClassPool, requests larger than its
+// biggest class (or more aligned than a chunk of it) go to the upstream resource
+template <size_t BlockSize = 1 << 16>
+class PoolResource : public std::pmr::memory_resource {
+private:
+    using PoolType = SizeClassPool<BlockSize>;
+    PoolType pool_;
+    std::pmr::memory_resource *upstream_;
+
+public:
+    explicit PoolResource(std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+        : upstream_(upstream) {}
+
+    std::pmr::memory_resource* upstream_resource() const {
+        return upstream_;
+    }
+
+    PoolType& pool() {
+        return pool_;
+    }
+
+private:
+    // Chunks of a power-of-two class are aligned to their own size
+    static size_t pooled_size(size_t bytes, size_t alignment) {
+        return std::max(bytes, alignment);
+    }
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        auto size = pooled_size(bytes, alignment);
+        if (size > PoolType::kMaxSize) {
+            return upstream_->allocate(bytes, alignment);
+        }
+
+        return pool_.allocate(size);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        auto size = pooled_size(bytes, alignment);
+        if (size > PoolType::kMaxSize) {
+            upstream_->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        pool_.deallocate(p, size);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+// Every allocation is aligned to at least Alignment bytes. Requests for an even
+// larger alignment are passed on to std::pmr::new_delete_resource().
+template <size_t Alignment = 64, typename Numa = NumaDefault>
+class AlignedResource : public std::pmr::memory_resource {
+private:
+    CacheAlignedAllocator<uint8_t, Alignment, Numa> alloc_;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (alignment > Alignment) {
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        // aligned_alloc() wants a multiple of the alignment
+        return alloc_.allocate(round_up(bytes));
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        if (alignment > Alignment) {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        alloc_.deallocate(static_cast<uint8_t *>(p), round_up(bytes));
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const AlignedResource *>(&other) != nullptr;
+    }
+
+    static size_t round_up(size_t bytes) {
+        return (std::max<size_t>(bytes, 1) + Alignment - 1) & ~(Alignment - 1);
+    }
+};
+
+// Every allocation is aligned to HugePageSize and backed by huge pages as far
+// as Mode allows
+template <size_t HugePageSize = 1 << 21, HugePageMode Mode = HugePageMode::Madvise,
+          Prefault Populate = Prefault::None, typename Numa = NumaDefault>
+class HugePageResource : public std::pmr::memory_resource {
+private:
+    THPAllocator<uint8_t, HugePageSize, Mode, Populate, Numa> alloc_;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (alignment > HugePageSize) {
+            throw std::bad_alloc();
+        }
+
+        return alloc_.allocate(bytes);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        (void) alignment;
+        alloc_.deallocate(static_cast<uint8_t *>(p), bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const HugePageResource *>(&other) != nullptr;
+    }
+};
+
+// Monotonic arena whose chunks come from the upstream resource, e.g. a
+// HugePageResource. Unlike std::pmr::monotonic_buffer_resource it can be
+// rewound with reset() and keep its chunks.
+class ArenaResource : public std::pmr::memory_resource {
+private:
+    using ArenaType = Arena<std::pmr::polymorphic_allocator<uint8_t>>;
+    ArenaType arena_;
+
+public:
+    explicit ArenaResource(std::pmr::memory_resource *upstream = std::pmr::get_default_resource(),
+                           size_t initial_size = 1 << 21)
+        : arena_(initial_size, std::pmr::polymorphic_allocator<uint8_t>(upstream)) {}
+
+    void reset() {
+        arena_.reset();
+    }
+
+    void release() {
+        arena_.release();
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        return arena_.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        (void) alignment;
+        arena_.deallocate(p, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+// Forwards to a resource it does not own, e.g. std::pmr::new_delete_resource()
+class ForwardingResource : public std::pmr::memory_resource {
+private:
+    std::pmr::memory_resource *upstream_;
+
+public:
+    explicit ForwardingResource(std::pmr::memory_resource *upstream) : upstream_(upstream) {}
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        return upstream_->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        upstream_->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other || upstream_->is_equal(other);
+    }
+};
+
+// Owns the upstream of a resource. It is a base listed before the resource, so
+// it is destroyed after it, once the resource has handed back all its memory.
+template <typename Upstream>
+struct UpstreamHolder {
+    Upstream upstream;
+};
+
+template <typename Resource, typename Upstream>
+class StackedResource : private UpstreamHolder<Upstream>, public Resource {
+public:
+    StackedResource() : Resource(&this->upstream) {}
+};
+
+/* Build a resource from a name, so the strategy can come from configuration
+   instead of the container type: "new_delete", "aligned", "huge_page", "pool",
+   "arena", and "pool+huge_page" / "arena+huge_page" for the pool or arena
+   stacked on a HugePageResource. Returns nullptr for an unknown name. */
+inline std::unique_ptr<std::pmr::memory_resource> make_memory_resource(const std::string& name) {
+    if (name == "new_delete") {
+        return std::make_unique<ForwardingResource>(std::pmr::new_delete_resource());
+    } else if (name == "aligned") {
+        return std::make_unique<AlignedResource<>>();
+    } else if (name == "huge_page") {
+        return std::make_unique<HugePageResource<>>();
+    } else if (name == "pool") {
+        return std::make_unique<PoolResource<>>();
+    } else if (name == "arena") {
+        return std::make_unique<ArenaResource>();
+    } else if (name == "pool+huge_page") {
+        return std::make_unique<StackedResource<PoolResource<>, HugePageResource<>>>();
+    } else if (name == "arena+huge_page") {
+        return std::make_unique<StackedResource<ArenaResource, HugePageResource<>>>();
+    }
+
+    return nullptr;
+}
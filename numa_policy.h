@@ -0,0 +1,244 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+constexpr size_t kMaxNumaNodes = 1024;
+using NumaNodeMask = std::bitset<kMaxNumaNodes>;
+
+// A node list of /sys/devices/system/node, e.g. "0-1" or "0,2-3"
+inline NumaNodeMask numa_read_node_list(const std::string& name) {
+    NumaNodeMask mask;
+    std::ifstream file("/sys/devices/system/node/" + name);
+    std::string range;
+    while (std::getline(file, range, ',')) {
+        size_t first = 0, last = 0;
+        char dash = 0;
+        std::istringstream in(range);
+        in >> first;
+        last = (in >> dash >> last) ? last : first;
+        for (size_t node = first; node <= last && node < kMaxNumaNodes; node++) {
+            mask.set(node);
+        }
+    }
+    return mask;
+}
+
+// Parsed once. Machines without NUMA support (or without sysfs) report a single node 0.
+inline const NumaNodeMask& numa_online_nodes() {
+    static const NumaNodeMask nodes = [] {
+        auto mask = numa_read_node_list("online");
+        if (mask.none()) {
+            mask.set(0);
+        }
+        return mask;
+    }();
+    return nodes;
+}
+
+/* Nodes with memory but no CPUs, which is how CXL-attached memory and PMEM in
+   system-RAM mode show up: a slower, cheaper tier behind the local DRAM. */
+inline const NumaNodeMask& numa_far_nodes() {
+    static const NumaNodeMask nodes = numa_read_node_list("has_memory") & ~numa_read_node_list("has_cpu");
+    return nodes;
+}
+
+// One past the highest online node, so node ids can index an array
+inline int numa_num_nodes() {
+    static const int count = [] {
+        int highest = 0;
+        for (size_t node = 0; node < kMaxNumaNodes; node++) {
+            if (numa_online_nodes().test(node)) {
+                highest = node;
+            }
+        }
+        return highest + 1;
+    }();
+    return count;
+}
+
+// Node of the CPU the calling thread is running on
+inline int numa_current_node() {
+    unsigned cpu = 0, node = 0;
+    if (getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+    return node;
+}
+
+// Memory tiers by access frequency: hot data belongs in local DRAM, cold data
+// on a far node, see numa_far_nodes()
+enum class MemoryTier {
+    Hot,
+    Cold,
+};
+
+/* The far node closest to node by the SLIT distances the kernel reports, or
+   node itself if there is no far node. Worked out for all nodes at once. */
+inline int numa_nearest_far_node(int node) {
+    static const std::vector<int> nearest = [] {
+        std::vector<int> online;
+        for (size_t n = 0; n < kMaxNumaNodes; n++) {
+            if (numa_online_nodes().test(n)) {
+                online.push_back(n);
+            }
+        }
+
+        std::vector<int> table(numa_num_nodes());
+        for (size_t i = 0; i < table.size(); i++) {
+            table[i] = i;
+            if (numa_far_nodes().none()) {
+                continue;
+            }
+
+            // One distance per online node, in node order
+            std::vector<int> distances;
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(i) + "/distance");
+            for (int distance; file >> distance;) {
+                distances.push_back(distance);
+            }
+
+            int best_distance = -1;
+            for (size_t j = 0; j < online.size(); j++) {
+                const int distance = j < distances.size() ? distances[j] : 0;
+                if (numa_far_nodes().test(online[j]) && (best_distance < 0 || distance < best_distance)) {
+                    table[i] = online[j];
+                    best_distance = distance;
+                }
+            }
+        }
+        return table;
+    }();
+    return node >= 0 && static_cast<size_t>(node) < nearest.size() ? nearest[node] : node;
+}
+
+// The node for data of a tier, seen from the calling thread: its own node for
+// hot data, the nearest far node for cold data (or its own again, without one)
+inline int numa_tier_node(MemoryTier tier) {
+    const int local = numa_current_node();
+    return tier == MemoryTier::Hot ? local : numa_nearest_far_node(local);
+}
+
+/* Set the memory policy of [p, p + size), which must be page aligned. Like
+   madvise() this only affects pages faulted in afterwards, so it has to run
+   before the range is first touched. Calls through the raw syscall to avoid a
+   dependency on libnuma. */
+inline bool numa_mbind(void *p, size_t size, int mode, const NumaNodeMask& nodes) {
+    constexpr size_t kBitsPerLong = 8 * sizeof(unsigned long);
+    unsigned long mask[kMaxNumaNodes / kBitsPerLong] = {};
+    for (size_t node = 0; node < kMaxNumaNodes; node++) {
+        if (nodes.test(node)) {
+            mask[node / kBitsPerLong] |= 1UL << (node % kBitsPerLong);
+        }
+    }
+
+    // The kernel ignores the last bit of maxnode
+    return syscall(SYS_mbind, p, size, mode, mask, kMaxNumaNodes + 1, 0) == 0;
+}
+
+inline bool numa_prefer_node(void *p, size_t size, int node) {
+    NumaNodeMask nodes;
+    nodes.set(node);
+    return numa_mbind(p, size, MPOL_PREFERRED, nodes);
+}
+
+/* Migrate the pages of [p, p + size) that are already faulted in to node with
+   move_pages(), e.g. to demote a cache gone cold to the far tier. The range is
+   widened to whole pages, and, as with mbind, a THP is moved as a whole.
+   Returns how many pages are on node afterwards. Only affects present pages:
+   set the policy of the range as well for the ones faulted in later. */
+inline size_t numa_move_pages(void *p, size_t size, int node) {
+    constexpr size_t kBatch = 4096;
+    static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+    const auto begin = reinterpret_cast<uintptr_t>(p) & ~(kPageSize - 1);
+    const auto end = reinterpret_cast<uintptr_t>(p) + size;
+
+    std::vector<void *> pages;
+    std::vector<int> nodes;
+    std::vector<int> status;
+    size_t moved = 0;
+    for (auto page = begin; page < end;) {
+        pages.clear();
+        for (; page < end && pages.size() < kBatch; page += kPageSize) {
+            pages.push_back(reinterpret_cast<void *>(page));
+        }
+        nodes.assign(pages.size(), node);
+        status.assign(pages.size(), -1);
+
+        // A positive result counts pages that could not be moved, their status says why
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nodes.data(), status.data(), MPOL_MF_MOVE) < 0) {
+            continue;
+        }
+        for (auto s : status) {
+            moved += s == node;
+        }
+    }
+    return moved;
+}
+
+// The node the page holding p is on, or -1 if it is not faulted in
+inline int numa_node_of(const void *p) {
+    static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+    void *page = reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(p) & ~(kPageSize - 1));
+    int status = -1;
+    if (syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0) {
+        return -1;
+    }
+    return status >= 0 ? status : -1;
+}
+
+/* Placement policies for the allocators' NUMA template parameter. Each one has
+   a static apply(p, size) that is called on freshly mapped, page aligned memory.
+   Failures are ignored, the same way the madvise() hints are. */
+
+// Leave placement to the kernel, i.e. first touch
+struct NumaDefault {
+    static void apply(void *p, size_t size) {
+        (void) p;
+        (void) size;
+    }
+};
+
+// Prefer the node of the allocating thread, not the one of the first thread
+// to touch the memory
+struct NumaLocal {
+    static void apply(void *p, size_t size) {
+        numa_prefer_node(p, size, numa_current_node());
+    }
+};
+
+// Spread the pages round-robin over all online nodes
+struct NumaInterleave {
+    static void apply(void *p, size_t size) {
+        numa_mbind(p, size, MPOL_INTERLEAVE, numa_online_nodes());
+    }
+};
+
+// Cold data: prefer the far tier of the allocating thread, see numa_tier_node().
+// Preferred, not bound, so allocations spill over to DRAM once it is full.
+struct NumaCold {
+    static void apply(void *p, size_t size) {
+        numa_prefer_node(p, size, numa_tier_node(MemoryTier::Cold));
+    }
+};
+
+// Hot data is what NumaLocal places already
+using NumaHot = NumaLocal;
+
+// Strictly place the pages on Node
+template <int Node>
+struct NumaBind {
+    static void apply(void *p, size_t size) {
+        NumaNodeMask nodes;
+        nodes.set(Node);
+        numa_mbind(p, size, MPOL_BIND, nodes);
+    }
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "pool_allocator.h"
+#include "tagged_stack.h"
+
+// How ObjectPool returns a released object to the state of a new one while
+// keeping what it has allocated: T::reset() if there is one, else T::clear(),
+// which keeps the capacity of strings, vectors and hash maps. Types with
+// neither need a Reset of their own.
+struct DefaultReset {
+    template <typename T>
+    void operator()(T& object) const {
+        if constexpr (has_reset<T>(0)) {
+            object.reset();
+        } else {
+            static_assert(has_clear<T>(0), "T has neither reset() nor clear(), give ObjectPool a Reset");
+            object.clear();
+        }
+    }
+
+private:
+    template <typename T>
+    static constexpr auto has_reset(int) -> decltype(std::declval<T&>().reset(), bool()) { return true; }
+    template <typename T>
+    static constexpr bool has_reset(...) { return false; }
+
+    template <typename T>
+    static constexpr auto has_clear(int) -> decltype(std::declval<T&>().clear(), bool()) { return true; }
+    template <typename T>
+    static constexpr bool has_clear(...) { return false; }
+};
+
+/* A pool of constructed T objects that are recycled rather than destroyed, so
+   the buffers they grew (string and vector capacity, ...) are reused by the
+   next acquire() instead of being freed and grown again. Released objects are
+   reset with Reset and kept on a lock-free stack of idle objects, which any
+   thread may acquire from or release to. Only creating a new object, when no
+   idle one is left, takes a lock: the slots are carved out of a Pool, which is
+   single-threaded.
+
+   Objects live until the ObjectPool is destroyed, which must happen after all
+   handles are gone. */
+template <typename T, typename Reset = DefaultReset, size_t BlockSize = 0>
+class ObjectPool {
+private:
+    // The link is next to the object, not in it, so idle objects stay intact
+    struct Slot {
+        T object;
+        std::atomic<Slot *> next{nullptr};
+    };
+
+    using Geometry = PoolGeometry<sizeof(Slot), alignof(Slot), BlockSize>;
+    using SlotPool = Pool<Geometry::kBlockSize, 0, alignof(Slot)>;
+
+    // Slots are only unmapped with the pool, so the stack can always read next
+    using IdleList = TaggedStack<Slot>;
+
+    IdleList idle_;
+    std::atomic<size_t> num_objects_{0};
+    std::mutex pool_mutex_;
+    SlotPool pool_{sizeof(Slot)};
+    [[no_unique_address]] Reset reset_;
+
+public:
+    // Owns one object, and gives it back to its pool when it goes away
+    class Handle {
+    private:
+        ObjectPool *pool_ = nullptr;
+        Slot *slot_ = nullptr;
+
+        friend class ObjectPool;
+
+        Handle(ObjectPool *pool, Slot *slot) : pool_(pool), slot_(slot) {}
+
+    public:
+        Handle() = default;
+
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+
+        Handle(Handle&& other) noexcept
+            : pool_(std::exchange(other.pool_, nullptr)), slot_(std::exchange(other.slot_, nullptr)) {}
+
+        Handle& operator=(Handle&& other) noexcept {
+            if (this != &other) {
+                reset();
+                pool_ = std::exchange(other.pool_, nullptr);
+                slot_ = std::exchange(other.slot_, nullptr);
+            }
+            return *this;
+        }
+
+        ~Handle() {
+            reset();
+        }
+
+        // Release the object to the pool now
+        void reset() {
+            if (slot_ != nullptr) {
+                pool_->release(std::exchange(slot_, nullptr));
+            }
+        }
+
+        T* get() const { return slot_ != nullptr ? &slot_->object : nullptr; }
+        T& operator*() const { return slot_->object; }
+        T* operator->() const { return &slot_->object; }
+        explicit operator bool() const { return slot_ != nullptr; }
+    };
+
+    ObjectPool() = default;
+
+    explicit ObjectPool(Reset reset) : reset_(std::move(reset)) {}
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    ~ObjectPool() {
+        for (auto slot = idle_.pop(); slot != nullptr; slot = idle_.pop()) {
+            slot->~Slot();
+        }
+    }
+
+    // An idle object if there is one, otherwise a default-constructed new one
+    Handle acquire() {
+        if (auto slot = idle_.pop()) {
+            return Handle(this, slot);
+        }
+
+        Slot *slot;
+        {
+            std::scoped_lock<std::mutex> lock(pool_mutex_);
+            slot = static_cast<Slot *>(pool_.allocate());
+        }
+
+        try {
+            new (slot) Slot();
+        } catch (...) {
+            std::scoped_lock<std::mutex> lock(pool_mutex_);
+            pool_.deallocate(slot);
+            throw;
+        }
+
+        num_objects_.fetch_add(1, std::memory_order_relaxed);
+        return Handle(this, slot);
+    }
+
+    // Objects created so far, idle or in use
+    size_t num_objects() const {
+        return num_objects_.load(std::memory_order_relaxed);
+    }
+
+private:
+    void release(Slot *slot) {
+        reset_(slot->object);
+        idle_.push(slot);
+    }
+};
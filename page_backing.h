@@ -0,0 +1,336 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+enum class HugePageMode {
+    // posix_memalign + madvise(MADV_HUGEPAGE), a hint khugepaged may never act on
+    Madvise,
+    // mmap(MAP_HUGETLB) from the reserved hugetlbfs pool, falling back to THP
+    // and then to base pages when no huge pages of that size are available
+    HugeTLB,
+};
+
+enum class PageBacking {
+    HugeTLB,
+    THP,
+    BasePages,
+};
+
+inline const char* to_string(PageBacking backing) {
+    switch (backing) {
+        case PageBacking::HugeTLB: return "hugetlbfs";
+        case PageBacking::THP: return "THP";
+        case PageBacking::BasePages: return "base pages";
+    }
+    return "unknown";
+}
+
+// MADV_HUGEPAGE is silently ignored when THP is set to "never"
+inline bool thp_enabled() {
+    static const bool enabled = [] {
+        std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string setting;
+        std::getline(file, setting);
+        return file && setting.find("[never]") == std::string::npos;
+    }();
+    return enabled;
+}
+
+// mmap only guarantees page alignment, so for larger alignments map alignment
+// extra bytes and unmap the misaligned head and tail. Returns nullptr on failure.
+inline void* map_aligned(size_t size, size_t alignment, int flags = 0, int prot = PROT_READ | PROT_WRITE) {
+    static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+    auto map_size = alignment > kPageSize ? size + alignment : size;
+    auto raw = mmap(nullptr, map_size, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (raw == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto start = reinterpret_cast<uintptr_t>(raw);
+    auto aligned = (start + alignment - 1) & ~(uintptr_t{alignment} - 1);
+    if (map_size != size) {
+        if (aligned != start) {
+            munmap(raw, aligned - start);
+        }
+        if (aligned + size != start + map_size) {
+            munmap(reinterpret_cast<void *>(aligned + size), start + map_size - aligned - size);
+        }
+    }
+
+    return reinterpret_cast<void *>(aligned);
+}
+
+// Fault in [p, p + size) for writing so that the first access does not take a
+// page fault. MADV_POPULATE_WRITE needs Linux 5.14, older kernels get one write
+// per page instead. With several threads the range is split on 2MB boundaries so
+// that no huge page is faulted by two threads at once.
+inline void prefault(void *p, size_t size, unsigned num_threads = 1) {
+    constexpr size_t kGranularity = 1 << 21;
+    static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+
+    auto populate = [](uint8_t *begin, size_t length) {
+        if (madvise(begin, length, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+
+        for (size_t i = 0; i < length; i += kPageSize) {
+            reinterpret_cast<volatile uint8_t *>(begin)[i] = 0;
+        }
+    };
+
+    auto begin = static_cast<uint8_t *>(p);
+    num_threads = std::max<size_t>(1, std::min<size_t>(num_threads, size / kGranularity));
+    if (num_threads == 1) {
+        populate(begin, size);
+        return;
+    }
+
+    const auto slice = (size / num_threads + kGranularity - 1) & ~(kGranularity - 1);
+    std::vector<std::thread> threads;
+    for (size_t offset = 0; offset < size; offset += slice) {
+        threads.emplace_back(populate, begin + offset, std::min(slice, size - offset));
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+/* Backing policies of Pool, i.e. where the memory its blocks are carved out of
+   comes from. map() returns size bytes aligned to alignment (both multiples of
+   page_size()) or nullptr, and reports what backs them, unmap() undoes it.
+   release() gives whole pages of a mapping back to the OS, the range stays
+   mapped. commit() makes part of a PROT_NONE reservation usable, see
+   AddressReservation. kContiguous policies map everything in one range. */
+struct BasePages {
+    static constexpr bool kContiguous = false;
+
+    static size_t page_size() {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    static void* map(size_t size, size_t alignment, PageBacking& backing) {
+        backing = PageBacking::BasePages;
+        return map_aligned(size, alignment);
+    }
+
+    static void unmap(void *p, size_t size) {
+        munmap(p, size);
+    }
+
+    static void release(void *p, size_t size) {
+        madvise(p, size, MADV_DONTNEED);
+    }
+
+    static bool commit(void *p, size_t size, PageBacking& backing) {
+        backing = PageBacking::BasePages;
+        return mprotect(p, size, PROT_READ | PROT_WRITE) == 0;
+    }
+};
+
+// Mappings of whole huge pages: MAP_HUGETLB with Mode == HugeTLB, or aligned
+// base pages with MADV_HUGEPAGE, which is also the fallback of HugeTLB
+template <size_t HugePageSize = 1 << 21, HugePageMode Mode = HugePageMode::Madvise>
+struct HugePages {
+    static_assert((HugePageSize & (HugePageSize - 1)) == 0, "HugePageSize must be a power of two");
+    static constexpr bool kContiguous = false;
+
+    static size_t page_size() {
+        return HugePageSize;
+    }
+
+    static void* map(size_t size, size_t alignment, PageBacking& backing) {
+        alignment = std::max(alignment, HugePageSize);
+        if constexpr (Mode == HugePageMode::HugeTLB) {
+            constexpr int kHugePageFlags = MAP_HUGETLB | (__builtin_ctzll(HugePageSize) << MAP_HUGE_SHIFT);
+
+            // hugetlbfs mappings are aligned to their page size already
+            void *p = nullptr;
+            if (alignment == HugePageSize) {
+                p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | kHugePageFlags, -1, 0);
+                p = p == MAP_FAILED ? nullptr : p;
+            } else {
+                p = map_aligned(size, alignment, kHugePageFlags);
+            }
+            if (p != nullptr) {
+                backing = PageBacking::HugeTLB;
+                return p;
+            }
+        }
+
+        // No reserved huge pages of this size: ask for THP instead
+        void *p = map_aligned(size, alignment);
+        if (p == nullptr) {
+            return nullptr;
+        }
+
+        if (thp_enabled() && madvise(p, size, MADV_HUGEPAGE) == 0) {
+            backing = PageBacking::THP;
+        } else {
+            backing = PageBacking::BasePages;
+        }
+        return p;
+    }
+
+    static void unmap(void *p, size_t size) {
+        munmap(p, size);
+    }
+
+    static void release(void *p, size_t size) {
+        madvise(p, size, MADV_DONTNEED);
+    }
+
+    // hugetlbfs pages replace the reserved range, THP is requested on it
+    static bool commit(void *p, size_t size, PageBacking& backing) {
+        if constexpr (Mode == HugePageMode::HugeTLB) {
+            constexpr int kHugePageFlags = MAP_HUGETLB | (__builtin_ctzll(HugePageSize) << MAP_HUGE_SHIFT);
+            if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | kHugePageFlags,
+                     -1, 0) != MAP_FAILED) {
+                backing = PageBacking::HugeTLB;
+                return true;
+            }
+        }
+
+        if (mprotect(p, size, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        backing = thp_enabled() && madvise(p, size, MADV_HUGEPAGE) == 0 ? PageBacking::THP : PageBacking::BasePages;
+        return true;
+    }
+};
+
+/* A range of virtual address space reserved up front with PROT_NONE, which
+   costs neither memory nor commit charge, and committed front to back with
+   Pages::commit() as it is needed. Everything committed stays at a stable
+   address and is contiguous with what was committed before, and whether a
+   pointer belongs to it is a range check. The range starts on a multiple of
+   kBaseAlignment, so commits aligned up to that (e.g. Pool blocks) waste no
+   address space. */
+template <typename Pages = BasePages>
+class AddressReservation {
+public:
+    static constexpr size_t kBaseAlignment = 1 << 21;
+
+private:
+    uint8_t *base_ = nullptr;
+    size_t size_ = 0;
+    size_t committed_ = 0;
+
+public:
+    AddressReservation() = default;
+
+    // size is rounded up to whole pages of Pages, the start is aligned to one
+    explicit AddressReservation(size_t size)
+        : size_((size + Pages::page_size() - 1) & ~(Pages::page_size() - 1)) {
+        base_ = static_cast<uint8_t *>(
+            map_aligned(size_, std::max(kBaseAlignment, Pages::page_size()), MAP_NORESERVE, PROT_NONE));
+        if (base_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    AddressReservation(const AddressReservation&) = delete;
+    AddressReservation& operator=(const AddressReservation&) = delete;
+
+    AddressReservation(AddressReservation&& other) noexcept
+        : base_(std::exchange(other.base_, nullptr)), size_(std::exchange(other.size_, 0)),
+          committed_(std::exchange(other.committed_, 0)) {}
+
+    AddressReservation& operator=(AddressReservation&& other) noexcept {
+        std::swap(base_, other.base_);
+        std::swap(size_, other.size_);
+        std::swap(committed_, other.committed_);
+        return *this;
+    }
+
+    ~AddressReservation() {
+        if (base_ != nullptr) {
+            munmap(base_, size_);
+        }
+    }
+
+    /* Commit the next size bytes (a multiple of the page size), starting at
+       the next address that is a multiple of alignment. Returns nullptr once
+       the reservation is exhausted or the pages cannot be committed. */
+    void* commit(size_t size, size_t alignment, PageBacking& backing) {
+        const auto base = reinterpret_cast<uintptr_t>(base_);
+        const size_t start = ((base + committed_ + alignment - 1) & ~(uintptr_t{alignment} - 1)) - base;
+        if (start > size_ || size > size_ - start || !Pages::commit(base_ + start, size, backing)) {
+            return nullptr;
+        }
+
+        committed_ = start + size;
+        return base_ + start;
+    }
+
+    bool contains(const void *p) const {
+        auto address = static_cast<const uint8_t *>(p);
+        return address >= base_ && address < base_ + committed_;
+    }
+
+    uint8_t* base() const {
+        return base_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t committed() const {
+        return committed_;
+    }
+};
+
+/* Pool backing that reserves ReserveSize bytes of address space per pool and
+   commits its regions one after the other, so all blocks of the pool are
+   adjacent (which the hardware prefetchers like) and the pool can tell its own
+   chunks apart with a range check. The pool cannot grow past ReserveSize. */
+template <size_t ReserveSize = size_t{1} << 32, typename Pages = BasePages>
+class ReservedRange {
+private:
+    AddressReservation<Pages> reservation_{ReserveSize};
+
+public:
+    static constexpr bool kContiguous = true;
+
+    static size_t page_size() {
+        return Pages::page_size();
+    }
+
+    void* map(size_t size, size_t alignment, PageBacking& backing) {
+        return reservation_.commit(size, alignment, backing);
+    }
+
+    // The reservation is unmapped as a whole
+    void unmap(void *p, size_t size) {
+        (void) p;
+        (void) size;
+    }
+
+    static void release(void *p, size_t size) {
+        Pages::release(p, size);
+    }
+
+    bool contains(const void *p) const {
+        return reservation_.contains(p);
+    }
+
+    const AddressReservation<Pages>& reservation() const {
+        return reservation_;
+    }
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct PerfEvent {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+/* Loads that hit a line modified in another core's cache (HITM), the event
+   false sharing shows up in. There is no generic perf event for it, so this is
+   the raw MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM (XSNP_FWD on newer cores) of Intel
+   CPUs since Skylake. Other CPUs need the raw event in $PERF_HITM_EVENT, e.g.
+   "0x04d2", without it the counter is left out. */
+inline uint64_t hitm_event() {
+    if (auto env = std::getenv("PERF_HITM_EVENT")) {
+        return std::strtoull(env, nullptr, 0);
+    }
+
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.rfind("vendor_id", 0) == 0) {
+            return line.find("GenuineIntel") != std::string::npos ? 0x04d2 : 0;
+        }
+    }
+    return 0;
+}
+
+inline std::vector<PerfEvent> cache_events() {
+    std::vector<PerfEvent> events = {
+        {"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {"l1d_misses", PERF_TYPE_HW_CACHE,
+         PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    if (auto hitm = hitm_event()) {
+        events.push_back({"hitm", PERF_TYPE_RAW, hitm});
+    }
+    return events;
+}
+
+/* Counts events of the calling thread and of every thread it starts after the
+   counters are opened (counts of exited threads are added to their parent), in
+   user space only so perf_event_paranoid <= 2 is enough. Events the kernel or
+   hypervisor does not support are skipped. Calls through the raw syscall, like
+   numa_mbind(), so there is no dependency on libpfm. */
+class PerfCounters {
+private:
+    struct Counter {
+        const char *name;
+        int fd;
+        uint64_t start;
+    };
+
+    std::vector<Counter> counters_;
+
+public:
+    explicit PerfCounters(const std::vector<PerfEvent>& events = cache_events()) {
+        for (const auto& event : events) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = event.type;
+            attr.config = event.config;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd >= 0) {
+                counters_.push_back({event.name, fd, 0});
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+        for (auto& counter : counters_) {
+            close(counter.fd);
+        }
+    }
+
+    // Whether any event could be opened
+    bool available() const {
+        return !counters_.empty();
+    }
+
+    void start() {
+        for (auto& counter : counters_) {
+            counter.start = read_counter(counter.fd);
+        }
+    }
+
+    // Events since start(), by name
+    std::vector<std::pair<std::string, uint64_t>> stop() const {
+        std::vector<std::pair<std::string, uint64_t>> counts;
+        for (const auto& counter : counters_) {
+            counts.emplace_back(counter.name, read_counter(counter.fd) - counter.start);
+        }
+        return counts;
+    }
+
+private:
+    static uint64_t read_counter(int fd) {
+        uint64_t value = 0;
+        if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+            return 0;
+        }
+        return value;
+    }
+};
@@ -0,0 +1,116 @@
+#include <cstdint>
+#include <string>
+#include <filesystem>
+#include <unordered_map>
+#include <unistd.h>
+#include "benchmark_util.h"
+#include "persistent_pool.h"
+
+// BENCHMARK CODE
+
+namespace {
+
+constexpr const uint64_t kNumKeys = 1 << 20;
+
+// A chained hash index linked with offset_ptr, so it can live in a PersistentPool
+struct IndexNode {
+    uint64_t key;
+    uint64_t value;
+    offset_ptr<IndexNode> next;
+};
+
+struct Index {
+    uint64_t num_buckets;
+    offset_ptr<offset_ptr<IndexNode>> buckets;
+};
+
+Index* build_index(PersistentPool& pool, uint64_t num_keys) {
+    auto index = new (pool.allocate_array(sizeof(Index))) Index{num_keys, nullptr};
+    auto buckets = static_cast<offset_ptr<IndexNode> *>(pool.allocate_array(sizeof(offset_ptr<IndexNode>) * num_keys));
+    for (uint64_t i = 0; i < num_keys; i++) {
+        new (&buckets[i]) offset_ptr<IndexNode>();
+    }
+    index->buckets = buckets;
+
+    for (uint64_t key = 0; key < num_keys; key++) {
+        auto& bucket = buckets[key * 0x9e3779b97f4a7c15 % num_keys];
+        bucket = new (pool.allocate()) IndexNode{key, key * 2, bucket};
+    }
+    pool.set_root(index);
+    return index;
+}
+
+uint64_t sum_index(const Index& index) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < index.num_buckets; i++) {
+        for (auto node = index.buckets[i].get(); node != nullptr; node = node->next.get()) {
+            sum += node->value;
+        }
+    }
+    return sum;
+}
+
+std::string index_path() {
+    return (std::filesystem::temp_directory_path() / ("allocator_benchmarks_" + std::to_string(getpid()) + ".pool"))
+        .string();
+}
+
+// What every deploy pays now: building the index in memory from scratch
+void BM_IndexRebuild(benchmark::State& state) {
+    for (auto _ : state) {
+        std::unordered_map<uint64_t, uint64_t> index;
+        for (uint64_t key = 0; key < kNumKeys; key++) {
+            index.emplace(key, key * 2);
+        }
+        benchmark::DoNotOptimize(index.size());
+        state.PauseTiming();
+        index.clear();
+        state.ResumeTiming();
+    }
+
+    set_operations(state, kNumKeys);
+}
+
+// Building it into a fresh file-backed pool, the first deploy
+void BM_PersistentIndexBuild(benchmark::State& state) {
+    const auto path = index_path();
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::filesystem::remove(path);
+        state.ResumeTiming();
+
+        PersistentPool pool(path, sizeof(IndexNode));
+        benchmark::DoNotOptimize(build_index(pool, kNumKeys));
+    }
+
+    std::filesystem::remove(path);
+    set_operations(state, kNumKeys);
+}
+
+/* Every later deploy: opening the file and paging the whole index in by
+   walking it, from the page cache here (a cold start adds the disk reads). */
+void BM_PersistentIndexReopen(benchmark::State& state) {
+    const auto path = index_path();
+    std::filesystem::remove(path);
+    size_t file_size = 0;
+    {
+        PersistentPool pool(path, sizeof(IndexNode));
+        build_index(pool, kNumKeys);
+        file_size = pool.file_size();
+    }
+
+    for (auto _ : state) {
+        PersistentPool pool(path, sizeof(IndexNode));
+        benchmark::DoNotOptimize(sum_index(*pool.root<Index>()));
+    }
+
+    std::filesystem::remove(path);
+    set_operations(state, kNumKeys);
+    state.counters["file_MB"] = file_size / double(1 << 20);
+}
+
+} // namespace
+
+BENCHMARK(BM_IndexRebuild)->Apply(configure);
+BENCHMARK(BM_PersistentIndexBuild)->Apply(configure);
+BENCHMARK(BM_PersistentIndexReopen)->Apply(configure);
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "page_backing.h"
+#include "allocation_profiler.h"
+
+/* A pointer that stores the distance from itself to its target instead of an
+   address, so a structure linked with offset_ptrs stays valid wherever the
+   mapping that holds it ends up, in the next run or in another process. Both
+   the offset_ptr and its target must live in the same mapping for that, e.g.
+   a PersistentPool. A distance of 1 stands for nullptr, as in
+   Boost.Interprocess: nothing in a pool is a byte away from where it points. */
+template <typename T>
+class offset_ptr {
+private:
+    static constexpr intptr_t kNull = 1;
+    intptr_t offset_ = kNull;
+
+    void set(const T *ptr) {
+        offset_ = ptr == nullptr ? kNull : reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(this);
+    }
+
+public:
+    offset_ptr() = default;
+    offset_ptr(std::nullptr_t) {}
+    offset_ptr(T *ptr) { set(ptr); }
+
+    // Copies point to the same target, from their own address
+    offset_ptr(const offset_ptr& other) { set(other.get()); }
+
+    offset_ptr& operator=(const offset_ptr& other) {
+        set(other.get());
+        return *this;
+    }
+
+    offset_ptr& operator=(T *ptr) {
+        set(ptr);
+        return *this;
+    }
+
+    T* get() const {
+        if (offset_ == kNull) {
+            return nullptr;
+        }
+        return reinterpret_cast<T *>(reinterpret_cast<intptr_t>(this) + offset_);
+    }
+
+    T& operator*() const { return *get(); }
+    T* operator->() const { return get(); }
+    T& operator[](size_t i) const { return get()[i]; }
+    explicit operator bool() const { return offset_ != kNull; }
+
+    bool operator==(const offset_ptr& other) const { return get() == other.get(); }
+    bool operator!=(const offset_ptr& other) const { return get() != other.get(); }
+};
+
+/* A pool of fixed-size chunks in a file mapped MAP_SHARED, so whatever is
+   built in it (linked with offset_ptr) survives the process: reopening the
+   file is an mmap, and the data is paged in from the page cache or disk as it
+   is touched instead of being rebuilt. The free list and the root, where the
+   entry point of the data structure is kept, are file offsets in a header at
+   the start of the file.
+
+   The file grows in place: it is mapped into an address range of max_size
+   bytes reserved up front, so chunks keep their address as long as the pool
+   is open. allocate_array() carves variable-sized, never freed allocations
+   (bucket arrays and the like) from the same file, arena style.
+
+   Other processes may map the same file to share the data, but only one
+   process at a time may allocate, and synchronizing readers is up to the
+   caller. Nothing is crash consistent either: sync() makes the file durable
+   at a point where the structure is consistent. */
+class PersistentPool {
+public:
+    static constexpr uint64_t kMagic = 0x4c4f'4f50'5041'4d4d;
+    static constexpr uint32_t kVersion = 2;
+    static constexpr size_t kMinFileSize = 1 << 20;
+
+private:
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t chunk_size;
+        // End of the part of the file handed out so far
+        uint64_t used;
+        // Offset of the first free chunk, which holds the offset of the next one, 0 for none
+        uint64_t free_list;
+        uint64_t root;
+        uint64_t live;
+        uint64_t alignment;
+    };
+
+    // Chunks start on a cache line after the header
+    static constexpr size_t kHeaderSize = 64;
+    static_assert(sizeof(Header) <= kHeaderSize, "kHeaderSize is too small");
+
+    int fd_ = -1;
+    uint8_t *base_ = nullptr;
+    size_t max_size_;
+    size_t mapped_ = 0;
+    size_t alignment_;
+    size_t chunk_size_;
+
+public:
+    /* Open the pool in the file at path, or create it with chunks of size bytes
+       aligned to alignment (a power of two) if the file does not exist or is
+       empty. An existing pool must have been created with the same chunk size
+       and alignment. */
+    PersistentPool(const std::string& path, size_t size, size_t max_size = size_t{1} << 36,
+                   size_t alignment = alignof(std::max_align_t))
+        : max_size_(page_round_up(max_size)), alignment_(std::max(alignment, alignof(uint64_t))),
+          chunk_size_(chunk_size(size, alignment_)) {
+        if ((alignment & (alignment - 1)) != 0) {
+            throw std::invalid_argument("PersistentPool alignment must be a power of two");
+        }
+
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+
+        try {
+            struct stat st;
+            if (fstat(fd_, &st) != 0) {
+                throw std::system_error(errno, std::generic_category(), "fstat " + path);
+            }
+            if (static_cast<size_t>(st.st_size) > max_size_) {
+                throw std::runtime_error(path + " is larger than max_size");
+            }
+
+            // Offsets aligned to alignment_ are addresses aligned to it
+            base_ = static_cast<uint8_t *>(
+                map_aligned(max_size_, std::max(alignment_, page_round_up(1)), MAP_NORESERVE, PROT_NONE));
+            if (base_ == nullptr) {
+                throw std::bad_alloc();
+            }
+
+            if (st.st_size == 0) {
+                grow(kMinFileSize);
+                *header() = Header{kMagic, kVersion, static_cast<uint32_t>(chunk_size_), kHeaderSize, 0, 0, 0, alignment_};
+            } else {
+                // Only whole pages are mapped, the last one must be in the file
+                const auto size = page_round_up(st.st_size);
+                if (size != static_cast<size_t>(st.st_size) && ftruncate(fd_, size) != 0) {
+                    throw std::system_error(errno, std::generic_category(), "ftruncate " + path);
+                }
+                map(size);
+                check_header(path);
+            }
+        } catch (...) {
+            if (base_ != nullptr) {
+                munmap(base_, max_size_);
+            }
+            close(fd_);
+            throw;
+        }
+    }
+
+    PersistentPool(const PersistentPool&) = delete;
+    PersistentPool& operator=(const PersistentPool&) = delete;
+
+    ~PersistentPool() {
+        munmap(base_, max_size_);
+        close(fd_);
+    }
+
+    void* allocate() {
+        auto h = header();
+        uint64_t offset = h->free_list;
+        if (offset != 0) {
+            h->free_list = *reinterpret_cast<uint64_t *>(base_ + offset);
+        } else {
+            offset = bump(chunk_size_, alignment_);
+        }
+
+        header()->live++;
+        profile_allocation(chunk_size_);
+        return base_ + offset;
+    }
+
+    void deallocate(void *ptr) {
+        auto h = header();
+        *static_cast<uint64_t *>(ptr) = h->free_list;
+        h->free_list = offset_of(ptr);
+        h->live--;
+    }
+
+    // size bytes that are only given back with the file, e.g. a bucket array
+    void* allocate_array(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        profile_allocation(size);
+        return base_ + bump(size, alignment);
+    }
+
+    // The entry point of what is stored in the pool, nullptr in a new one
+    template <typename T>
+    T* root() const {
+        auto offset = header()->root;
+        return offset != 0 ? reinterpret_cast<T *>(base_ + offset) : nullptr;
+    }
+
+    void set_root(const void *ptr) {
+        header()->root = ptr != nullptr ? offset_of(ptr) : 0;
+    }
+
+    // Write everything back to the file and wait for it
+    void sync() {
+        if (msync(base_, mapped_, MS_SYNC) != 0) {
+            throw std::system_error(errno, std::generic_category(), "msync");
+        }
+    }
+
+    uint64_t offset_of(const void *ptr) const {
+        return static_cast<const uint8_t *>(ptr) - base_;
+    }
+
+    void* at(uint64_t offset) const {
+        return base_ + offset;
+    }
+
+    bool contains(const void *ptr) const {
+        auto address = static_cast<const uint8_t *>(ptr);
+        return address >= base_ + kHeaderSize && address < base_ + header()->used;
+    }
+
+    size_t chunk_size() const {
+        return chunk_size_;
+    }
+
+    size_t live() const {
+        return header()->live;
+    }
+
+    size_t file_size() const {
+        return mapped_;
+    }
+
+private:
+    // Whole multiples of the alignment, so chunks bumped one after the other
+    // leave no gaps
+    static size_t chunk_size(size_t size, size_t alignment) {
+        return (std::max(size, sizeof(uint64_t)) + alignment - 1) & ~(alignment - 1);
+    }
+
+    static size_t page_round_up(size_t size) {
+        static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+        return (size + kPageSize - 1) & ~(kPageSize - 1);
+    }
+
+    Header* header() const {
+        return reinterpret_cast<Header *>(base_);
+    }
+
+    void check_header(const std::string& path) {
+        auto h = header();
+        if (mapped_ < kHeaderSize || h->magic != kMagic) {
+            throw std::runtime_error(path + " is not a PersistentPool");
+        }
+        if (h->version != kVersion) {
+            throw std::runtime_error(path + " has an unsupported PersistentPool version");
+        }
+        if (h->alignment != alignment_) {
+            throw std::runtime_error(path + " holds chunks aligned to " + std::to_string(h->alignment) + " bytes, not " +
+                                     std::to_string(alignment_));
+        }
+        if (h->chunk_size != chunk_size_) {
+            throw std::runtime_error(path + " holds chunks of " + std::to_string(h->chunk_size) + " bytes, not " +
+                                     std::to_string(chunk_size_));
+        }
+        if (h->used > mapped_) {
+            throw std::runtime_error(path + " is truncated");
+        }
+    }
+
+    // Take size bytes aligned to alignment off the end of the used part
+    uint64_t bump(size_t size, size_t alignment) {
+        auto h = header();
+        const uint64_t offset = (h->used + alignment - 1) & ~(uint64_t{alignment} - 1);
+        if (offset + size > mapped_) {
+            grow(offset + size);
+        }
+
+        header()->used = offset + size;
+        return offset;
+    }
+
+    // Extend the file to at least size bytes, doubling it, and map the new part
+    // right behind the old one
+    void grow(size_t size) {
+        if (size > max_size_) {
+            throw std::bad_alloc();
+        }
+
+        const auto new_size = std::min(max_size_, page_round_up(std::max({size, 2 * mapped_, kMinFileSize})));
+        if (ftruncate(fd_, new_size) != 0) {
+            throw std::bad_alloc();
+        }
+        map(new_size);
+    }
+
+    void map(size_t size) {
+        const auto length = page_round_up(size) - mapped_;
+        if (mmap(base_ + mapped_, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd_, mapped_) ==
+            MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        mapped_ += length;
+    }
+};
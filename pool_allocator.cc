@@ -1,150 +1,345 @@
-#include <stack>
 #include <memory>
 #include <list>
-#include <chrono>
-#include <iostream>
-
-template <size_t BlockSize, size_t ReservedBlocks = 0>
-class Pool {
-private:
-    size_t size_;
-    std::stack<void *> addrs_;
-    std::stack<std::unique_ptr<uint8_t[]>> blocks_;
-
-public:
-    explicit Pool(size_t size) : size_(size) {
-        for (size_t i = 0; i < ReservedBlocks; i++) {
-            add_more_addresses();
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <string>
+#include "benchmark_util.h"
+#include "pool_allocator.h"
+#include "size_class_allocator.h"
+#include "concurrent_pool_allocator.h"
+#include "cache_aligned_allocator.h"
+#include "object_pool.h"
+
+// BENCHMARK CODE
+
+namespace {
+
+struct Node {
+    void *prev;
+    void *next;
+    int value;
+};
+
+template <typename Allocator>
+void BM_ListEmplace(benchmark::State& state) {
+    constexpr const int kNumElems = 1000000;
+
+    for (auto _ : state) {
+        {
+            std::list<int, Allocator> l;
+            for (int i = 0; i < kNumElems; i++) {
+                l.emplace_back(i);
+            }
+
+            // Only the insertions are timed, not tearing the list down
+            state.PauseTiming();
         }
+        state.ResumeTiming();
     }
 
-    void* allocate() {
-        if (addrs_.empty()) {
-            add_more_addresses();
-        }
+    set_operations(state, kNumElems);
+}
 
-        auto ptr = addrs_.top();
-        addrs_.pop();
-        return ptr;
-    }
+/* The same with capacity for the whole list reserved (and prefaulted, with
+   range(0)) at runtime before the timed part, instead of with ReservedBlocks.
+   Node has the size and alignment of a list node, so its allocator shares the
+   pool the list allocates its nodes from. */
+template <typename Allocator>
+void BM_ListEmplacePrewarmed(benchmark::State& state) {
+    constexpr const int kNumElems = 1000000;
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
 
-    void deallocate(void *ptr) {
-        addrs_.push(ptr);
-    }
+    for (auto _ : state) {
+        state.PauseTiming();
+        {
+            Allocator alloc;
+            NodeAllocator(alloc).reserve(kNumElems, state.range(0) != 0);
+            std::list<int, Allocator> l(alloc);
+            state.ResumeTiming();
+            for (int i = 0; i < kNumElems; i++) {
+                l.emplace_back(i);
+            }
 
-    /* Rebind should only be called by STL containers when they need to create
-       an allocator for an internal node-like structure from the value_type allocator.
-       This means that the original allocator must not have been used yet, so we
-       are free to reassign the size_ field safely. */
-    void rebind(size_t size) {
-        if (!(addrs_.empty() && blocks_.empty())) {
-            std::cerr << "Cannot call Pool::rebind() after an allocation\n";
-            abort();
+            state.PauseTiming();
         }
+        state.ResumeTiming();
+    }
+
+    set_operations(state, kNumElems);
+}
 
-        size_ = size;
+// The same with AllocatorStats attached, to see what the counters cost and how
+// much memory the pool reserves for the list
+template <typename Allocator>
+void BM_ListEmplaceWithStats(benchmark::State& state) {
+    constexpr const int kNumElems = 1000000;
+    AllocatorStats::Snapshot snapshot;
+
+    for (auto _ : state) {
+        {
+            AllocatorStats stats;
+            Allocator alloc;
+            alloc.set_stats(&stats);
+            std::list<int, Allocator> l(alloc);
+            for (int i = 0; i < kNumElems; i++) {
+                l.emplace_back(i);
+            }
+
+            state.PauseTiming();
+            snapshot = stats.snapshot();
+        }
+        state.ResumeTiming();
     }
 
-private:
-    // Refill the address stack by allocating another block of memory
-    void add_more_addresses() {
-        auto block = std::make_unique<uint8_t[]>(BlockSize);
-        auto total_size = BlockSize % size_ == 0 ? BlockSize : BlockSize - size_;
+    set_operations(state, kNumElems);
+    state.counters["live_MB"] = snapshot.live_bytes / double(1 << 20);
+    state.counters["peak_reserved_MB"] = snapshot.peak_reserved_bytes / double(1 << 20);
+}
+
+// Many small, growing vectors: every emplace_back that exceeds the capacity is an n > 1 allocation
+// (pooled by PoolAllocator up to PoolRegistry::kMaxArraySize bytes)
+template <typename Allocator>
+void BM_SmallVectors(benchmark::State& state) {
+    constexpr const int kNumVectors = 100000;
+    constexpr const int kMaxElems = 64;
+    int64_t ops = 0;
+
+    for (auto _ : state) {
+        {
+            Allocator alloc;
+            std::vector<std::vector<int, Allocator>> vectors;
+            vectors.reserve(kNumVectors);
+
+            for (int i = 0; i < kNumVectors; i++) {
+                auto& v = vectors.emplace_back(alloc);
+                for (int j = 0; j < i % kMaxElems; j++) {
+                    v.emplace_back(j);
+                }
+            }
 
-        // Divide the allocated block into chunks of size_ bytes, and add their address
-        for (size_t i = 0; i < total_size; i += size_) {
-            addrs_.push(&block.get()[i]);
+            ops = vectors.size();
+            state.PauseTiming();
         }
+        state.ResumeTiming();
+    }
+
+    set_operations(state, ops);
+}
+
+// Latency distribution of single allocations in a steady state of reuse
+template <typename Allocator>
+void BM_AllocateLatency(benchmark::State& state) {
+    constexpr const int kBatch = 1024;
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    NodeAllocator alloc;
+    std::vector<Node *> nodes(kBatch);
+    LatencySamples samples;
 
-        // Keep the memory of the block alive by adding it to our stack
-        blocks_.push(std::move(block));
+    for (auto _ : state) {
+        for (auto& node : nodes) {
+            samples.time([&] { node = alloc.allocate(1); });
+            benchmark::DoNotOptimize(node);
+        }
+        for (auto node : nodes) {
+            alloc.deallocate(node, 1);
+        }
     }
-};
 
-template <typename T, size_t BlockSize = 4096, size_t ReservedBlocks = 0>
-class PoolAllocator {
-private:
-    using PoolType = Pool<BlockSize, ReservedBlocks>;
-    std::shared_ptr<PoolType> pool_;
+    set_operations(state, kBatch);
+    samples.report(state);
+}
 
-public:
-    using value_type = T;
-    using is_always_equal = std::false_type;
+/* In-order traversal of a large std::map whose nodes were inserted in random
+   key order, so consecutive nodes are scattered across the whole pool and
+   nearly every step needs another TLB entry with 4 KiB pages. Only the
+   traversal is timed. */
+template <typename Allocator>
+void BM_MapTraversal(benchmark::State& state) {
+    constexpr const int kNumElems = 1 << 20;
+    std::vector<int> keys(kNumElems);
+    for (int i = 0; i < kNumElems; i++) {
+        keys[i] = i;
+    }
+    std::shuffle(keys.begin(), keys.end(), std::minstd_rand(42));
 
-    PoolAllocator() : pool_(std::make_shared<PoolType>(sizeof(T))) {}
+    std::map<int, int, std::less<int>, Allocator> map;
+    for (auto key : keys) {
+        map.emplace(key, key);
+    }
 
-    // Rebind copy constructor
-    template <typename U>
-    PoolAllocator(const PoolAllocator<U>& other) : pool_{other.pool_} {
-        pool_->rebind(sizeof(T));
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (const auto& [key, value] : map) {
+            sum += value;
+        }
+        benchmark::DoNotOptimize(sum);
     }
 
-    template <typename U>
-    struct rebind {
-        using other = PoolAllocator<U, BlockSize, ReservedBlocks>;
-    };
+    set_operations(state, kNumElems);
+}
 
-    PoolAllocator(const PoolAllocator& other) = default;
-    PoolAllocator(PoolAllocator&& other) = default;
-    PoolAllocator& operator=(const PoolAllocator& other) = default;
-    PoolAllocator& operator=(PoolAllocator&& other) = default;
+// A pipeline stage allocating and freeing messages in batches of range(0),
+// one chunk per call or the whole batch with allocate_bulk()/deallocate_bulk()
+template <typename Allocator, bool Bulk>
+void BM_Batches(benchmark::State& state) {
+    const int kBatch = state.range(0);
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    NodeAllocator alloc;
+    std::vector<Node *> nodes(kBatch);
 
-    T* allocate(size_t n) {
-        if (n > 1) {
-            // For n > 1, resort to using malloc
-            return static_cast<T*>(malloc(sizeof(T) * n));
+    for (auto _ : state) {
+        if constexpr (Bulk) {
+            alloc.allocate_bulk(kBatch, nodes.data());
+        } else {
+            for (auto& node : nodes) {
+                node = alloc.allocate(1);
+            }
         }
+        benchmark::DoNotOptimize(nodes.data());
 
-        return static_cast<T*>(pool_->allocate());
+        if constexpr (Bulk) {
+            alloc.deallocate_bulk(nodes.data(), kBatch);
+        } else {
+            for (auto node : nodes) {
+                alloc.deallocate(node, 1);
+            }
+        }
     }
 
-    void deallocate(T* ptr, size_t n) {
-        if (n > 1) {
-            free(ptr);
-            return;
+    set_operations(state, kBatch);
+}
+
+void batch_sizes(benchmark::internal::Benchmark *b) {
+    configure(b);
+    b->RangeMultiplier(2)->Range(32, 256);
+}
+
+// AVX-512 packet buffers: each one must start on a cache line
+struct alignas(64) Packet {
+    uint8_t data[256];
+};
+
+template <typename Allocator>
+void BM_PacketBuffers(benchmark::State& state) {
+    constexpr const int kBatch = 256;
+    Allocator alloc;
+    std::vector<Packet *> packets(kBatch);
+
+    for (auto _ : state) {
+        for (auto& packet : packets) {
+            packet = alloc.allocate(1);
+            packet->data[0] = 1;
+            benchmark::DoNotOptimize(packet);
+        }
+        for (auto packet : packets) {
+            alloc.deallocate(packet, 1);
         }
+    }
+
+    set_operations(state, kBatch);
+}
+
+// A parsed request, with strings and a vector that grow while it is filled in
+struct Request {
+    std::string method;
+    std::string path;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
 
-        pool_->deallocate(ptr);
+    void reset() {
+        method.clear();
+        path.clear();
+        headers.clear();
+        body.clear();
     }
 };
 
+void parse_request(Request& request, int i) {
+    request.method = "POST";
+    request.path = "/api/v1/accounts/" + std::to_string(i) + "/transactions";
+    for (int j = 0; j < 8; j++) {
+        request.headers.emplace_back("x-header-name-" + std::to_string(j), "some header value of size");
+    }
+    request.body.assign(512, 'x');
+}
 
-// BENCHMARK CODE
+struct NewRequests {
+    using Handle = std::unique_ptr<Request>;
 
-template <typename T, typename Allocator = std::allocator<T>>
-int64_t run_benchmark() {
-    constexpr const int kNumElems = 1000000;
-    std::list<int, Allocator> l;
+    Handle acquire() { return std::make_unique<Request>(); }
+};
 
-    auto start = std::chrono::steady_clock::now();
-    for (int i = 0; i < kNumElems; i++) {
-        l.emplace_back(i);
+/* Request objects parsed and dropped in batches of kBatch in flight: a new
+   Request per parse allocates all of its buffers again, ObjectPool hands out
+   reset ones that kept their capacity. */
+template <typename Requests>
+void BM_RequestObjects(benchmark::State& state) {
+    constexpr const int kBatch = 64;
+    Requests requests;
+    std::vector<typename Requests::Handle> in_flight(kBatch);
+    int i = 0;
+
+    for (auto _ : state) {
+        for (auto& request : in_flight) {
+            request = requests.acquire();
+            parse_request(*request, i++);
+            benchmark::DoNotOptimize(request->body.data());
+        }
+        for (auto& request : in_flight) {
+            request = {};
+        }
     }
 
-    auto stop = std::chrono::steady_clock::now();
-    return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+    set_operations(state, kBatch);
 }
 
+} // namespace
 
+BENCHMARK_TEMPLATE(BM_ListEmplace, std::allocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplace, PoolAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplace, PoolAllocator<int, 4096, 100>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplace, PoolAllocator<int, 4096, 1000>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplace, PoolAllocator<int, 4096, 0, NumaPool>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplace, PoolAllocator<int, 0, 0, ReservedPool>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplace, ConcurrentPoolAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplace, SizeClassAllocator<int>)->Apply(configure);
 
-int main() {
-    constexpr int iterations = 10;
-    int64_t std_alloc_mean = 0;
-    int64_t custom_alloc_no_reserved_mean = 0;
-    int64_t custom_alloc_100_reserved_mean = 0;
-    int64_t custom_alloc_1000_reserved_mean = 0;
+BENCHMARK_TEMPLATE(BM_ListEmplacePrewarmed, PoolAllocator<int>)->Apply(configure)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ListEmplacePrewarmed, PoolAllocator<int, 0, 0, NumaPool>)->Apply(configure)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ListEmplacePrewarmed, ConcurrentPoolAllocator<int>)->Apply(configure)->Arg(0)->Arg(1);
 
-    for (int i = 0; i < iterations; i++) {
-        std_alloc_mean += run_benchmark<int>();
-        custom_alloc_no_reserved_mean += run_benchmark<int, PoolAllocator<int>>();
-        custom_alloc_100_reserved_mean += run_benchmark<int, PoolAllocator<int, 4096, 100>>();
-        custom_alloc_1000_reserved_mean += run_benchmark<int, PoolAllocator<int, 4096, 1000>>();
-    }
+BENCHMARK_TEMPLATE(BM_ListEmplaceWithStats, PoolAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplaceWithStats, ConcurrentPoolAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_ListEmplaceWithStats, SizeClassAllocator<int>)->Apply(configure);
+
+BENCHMARK_TEMPLATE(BM_SmallVectors, std::allocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_SmallVectors, PoolAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_SmallVectors, SizeClassAllocator<int>)->Apply(configure);
+
+BENCHMARK_TEMPLATE(BM_AllocateLatency, std::allocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_AllocateLatency, PoolAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_AllocateLatency, ConcurrentPoolAllocator<int>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_AllocateLatency, SizeClassAllocator<int>)->Apply(configure);
+
+BENCHMARK_TEMPLATE(BM_MapTraversal, std::allocator<std::pair<const int, int>>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_MapTraversal, PoolAllocator<std::pair<const int, int>>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_MapTraversal, PoolAllocator<std::pair<const int, int>, 0, 0, HugePagePool>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_MapTraversal, PoolAllocator<std::pair<const int, int>, 0, 0, HugeTLBPool>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_MapTraversal, PoolAllocator<std::pair<const int, int>, 0, 0, ReservedPool>)->Apply(configure);
+
+BENCHMARK_TEMPLATE(BM_Batches, PoolAllocator<int>, false)->Apply(batch_sizes);
+BENCHMARK_TEMPLATE(BM_Batches, PoolAllocator<int>, true)->Apply(batch_sizes);
+BENCHMARK_TEMPLATE(BM_Batches, PoolAllocator<int, 4096, 0, NumaPool>, false)->Apply(batch_sizes);
+BENCHMARK_TEMPLATE(BM_Batches, PoolAllocator<int, 4096, 0, NumaPool>, true)->Apply(batch_sizes);
+BENCHMARK_TEMPLATE(BM_Batches, ConcurrentPoolAllocator<int>, false)->Apply(batch_sizes);
+BENCHMARK_TEMPLATE(BM_Batches, ConcurrentPoolAllocator<int>, true)->Apply(batch_sizes);
 
-    std::cout << "std::allocator            mean: "  << std_alloc_mean / iterations << " μs\n";
-    std::cout << "PoolAllocator<4096, 0>    mean: "  << custom_alloc_no_reserved_mean / iterations << " μs\n";
-    std::cout << "PoolAllocator<4096, 100>  mean: "  << custom_alloc_100_reserved_mean / iterations << " μs\n";
-    std::cout << "PoolAllocator<4096, 1000> mean: " << custom_alloc_1000_reserved_mean / iterations << " μs\n";
+BENCHMARK_TEMPLATE(BM_PacketBuffers, std::allocator<Packet>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_PacketBuffers, CacheAlignedAllocator<Packet>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_PacketBuffers, CacheAlignedPoolAllocator<Packet>)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_PacketBuffers, ConcurrentPoolAllocator<Packet, 1 << 16, 64, 64>)->Apply(configure);
 
-    return 0;
-}
\ No newline at end of file
+BENCHMARK_TEMPLATE(BM_RequestObjects, NewRequests)->Apply(configure);
+BENCHMARK_TEMPLATE(BM_RequestObjects, ObjectPool<Request>)->Apply(configure);
@@ -0,0 +1,1041 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "numa_policy.h"
+#include "page_backing.h"
+#include "allocator_stats.h"
+#include "allocation_profiler.h"
+#include "hardening.h"
+
+/* Block layout of a Pool. Every chunk holds at least the free list link (and
+   the free canary in hardened builds) and is rounded up to its alignment, so
+   consecutive chunks stay aligned. The header of a block takes
+   kPoolBlockHeaderSize bytes at its end, the rest is chunks. */
+constexpr size_t kPoolBlockHeaderSize = 3 * sizeof(void *);
+constexpr size_t kPoolFreeChunkSize = (hardening::kEnabled ? 2 : 1) * sizeof(void *);
+
+constexpr size_t pool_chunk_size(size_t size, size_t alignment = alignof(void *)) {
+    const auto align = std::max(alignment, alignof(void *));
+    return (std::max(size, kPoolFreeChunkSize) + align - 1) / align * align;
+}
+
+constexpr size_t pool_chunks_per_block(size_t block_size, size_t chunk_size) {
+    return block_size > kPoolBlockHeaderSize ? (block_size - kPoolBlockHeaderSize) / chunk_size : 0;
+}
+
+/* The smallest block, from a 4 KiB page up to a 2 MiB huge page, that holds at
+   least kMinChunks chunks and wastes at most 1/16 of it in the tail. Chunks too
+   large for that get 2 MiB blocks. */
+constexpr size_t pool_block_size(size_t chunk_size) {
+    constexpr size_t kMinBlockSize = 4096;
+    constexpr size_t kMaxBlockSize = 1 << 21;
+    constexpr size_t kMinChunks = 64;
+
+    size_t block_size = kMinBlockSize;
+    for (; block_size < kMaxBlockSize; block_size *= 2) {
+        const auto chunks = pool_chunks_per_block(block_size, chunk_size);
+        const auto waste = block_size - kPoolBlockHeaderSize - chunks * chunk_size;
+        if (chunks >= kMinChunks && waste <= block_size / 16) {
+            break;
+        }
+    }
+    return block_size;
+}
+
+// Geometry of the blocks for objects of Size bytes aligned to Alignment, all
+// derived at compile time. A BlockSize of 0 picks it with pool_block_size().
+template <size_t Size, size_t Alignment, size_t BlockSize = 0>
+struct PoolGeometry {
+    static constexpr size_t kChunkSize = pool_chunk_size(Size, Alignment);
+    static constexpr size_t kBlockSize = BlockSize != 0 ? BlockSize : pool_block_size(kChunkSize);
+    static constexpr size_t kChunksPerBlock = pool_chunks_per_block(kBlockSize, kChunkSize);
+    static constexpr size_t kWastedBytes = kBlockSize - kPoolBlockHeaderSize - kChunksPerBlock * kChunkSize;
+};
+
+/* Chunks are aligned to Alignment: blocks are BlockSize-aligned and chunk sizes
+   are rounded up to a multiple of Alignment, e.g. 64 so objects get a cache
+   line of their own, or the alignment of AVX-512 vectors.
+
+   Backing is where the regions blocks are carved out of come from, see
+   page_backing.h. With HugePages, regions are whole huge pages, so the chunks
+   of neighbouring blocks share a TLB entry. Blocks smaller than a page of the
+   backing are then never released to the OS by trim(), which would split the
+   huge page, only kept for reuse. With ReservedRange, all regions are
+   committed one after the other in an address range reserved up front.
+
+   A pool is single-threaded, unless it is ThreadOwned: then it belongs to the
+   thread that created it (see set_owner()), which alone may allocate, while
+   any thread may free. Frees from other threads are pushed onto a lock-free
+   remote-free list (multiple producers, one consumer) that the owner takes
+   over in one exchange once its own free list runs dry, before growing. */
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t Alignment = alignof(void *),
+          typename Backing = BasePages, bool ThreadOwned = false>
+class Pool {
+private:
+    static_assert((BlockSize & (BlockSize - 1)) == 0, "BlockSize must be a power of two");
+    static_assert((Alignment & (Alignment - 1)) == 0, "Alignment must be a power of two");
+    static_assert(Alignment <= BlockSize / 2, "Alignment must leave room for a chunk and the block header");
+
+    // A free chunk stores the link to the next free chunk in its own memory,
+    // so the free list needs no storage of its own
+    struct FreeChunk {
+        FreeChunk *next;
+    };
+
+    // Blocks are BlockSize-aligned, so the header at the end of a block can be
+    // found from any chunk address by masking. It counts the chunks handed out
+    // and records the pool the block belongs to.
+    struct BlockHeader {
+        BlockHeader *next;
+        size_t live;
+        Pool *owner;
+    };
+
+    static_assert(sizeof(BlockHeader) == kPoolBlockHeaderSize, "kPoolBlockHeaderSize is out of date");
+
+    static constexpr size_t kReleased = std::numeric_limits<size_t>::max();
+    static constexpr size_t kMaxRegionBlocks = BlockSize < (1 << 20) ? (1 << 20) / BlockSize : 1;
+
+    // Declared first, a ReservedRange must outlive the regions mapped from it
+    Backing backing_;
+    size_t size_;
+    size_t chunks_per_block_;
+    int numa_node_;
+    FreeChunk *free_list_ = nullptr;
+    BlockHeader *blocks_ = nullptr;
+    size_t num_blocks_ = 0;
+    size_t empty_blocks_ = 0;
+    size_t trim_threshold_ = 0;
+    size_t reserved_blocks_ = ReservedBlocks;
+    uint8_t *spare_ = nullptr;
+    size_t spare_blocks_ = 0;
+    size_t region_blocks_ = std::max<size_t>(1, Backing::page_size() / BlockSize);
+    size_t max_region_blocks_ = std::max(kMaxRegionBlocks, region_blocks_);
+    PageBacking last_backing_ = PageBacking::BasePages;
+    std::vector<std::pair<void *, size_t>> regions_;
+    std::vector<uint8_t *> released_;
+    AllocatorStats *stats_ = nullptr;
+
+    // On a line of its own, so remote frees do not slow down the owner's fields
+    struct alignas(64) RemoteFrees {
+        std::atomic<FreeChunk *> head{nullptr};
+        std::atomic<std::thread::id> owner{std::this_thread::get_id()};
+    };
+
+    struct NoRemoteFrees {};
+
+    std::conditional_t<ThreadOwned, RemoteFrees, NoRemoteFrees> remote_;
+
+public:
+    // A numa_node >= 0 makes the blocks prefer that node instead of the node of
+    // the first thread to touch them
+    explicit Pool(size_t size, int numa_node = -1)
+        : size_(pool_chunk_size(size, Alignment)), chunks_per_block_(pool_chunks_per_block(BlockSize, size_)),
+          numa_node_(numa_node) {
+        for (size_t i = 0; i < ReservedBlocks; i++) {
+            add_more_addresses();
+        }
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    ~Pool() {
+        if (stats_ != nullptr) {
+            stats_->on_release(num_blocks_ * BlockSize);
+        }
+        for (auto& region : regions_) {
+            hardening::unpoison(region.first, region.second);
+            backing_.unmap(region.first, region.second);
+        }
+    }
+
+    void* allocate() {
+        if (free_list_ == nullptr) {
+            refill();
+        }
+
+        auto chunk = free_list_;
+        check_free(chunk);
+        free_list_ = chunk->next;
+        if (header(chunk)->live++ == 0) {
+            empty_blocks_--;
+        }
+        if (stats_ != nullptr) {
+            stats_->on_allocate(size_);
+        }
+        profile_allocation(size_);
+        return chunk;
+    }
+
+    void deallocate(void *ptr) {
+        if (stats_ != nullptr) {
+            stats_->on_deallocate(size_);
+        }
+
+        check_freeable(ptr);
+        if constexpr (ThreadOwned) {
+            if (!is_owner()) {
+                auto chunk = new (ptr) FreeChunk{nullptr};
+                mark_free(chunk);
+                push_remote(chunk, chunk);
+                return;
+            }
+        }
+
+        free_list_ = new (ptr) FreeChunk{free_list_};
+        mark_free(free_list_);
+        if (--header(ptr)->live == 0) {
+            empty_blocks_++;
+            if (trim_threshold_ != 0 && empty_blocks_ > trim_threshold_) {
+                trim(trim_threshold_ / 2);
+            }
+        }
+    }
+
+    /* Allocate n chunks into out[0, n) at once. They come off the free list as a
+       chain, the live count of their block is updated once per run of chunks
+       from the same block, and the stats and profiler hooks run once per batch.
+       If the pool cannot grow the chunks taken so far are put back. */
+    template <typename T>
+    void allocate_bulk(size_t n, T **out) {
+        size_t taken = 0;
+        try {
+            while (taken < n) {
+                if (free_list_ == nullptr) {
+                    refill();
+                }
+                taken += pop_chain(n - taken, out + taken);
+            }
+        } catch (...) {
+            push_chain(out, taken);
+            throw;
+        }
+
+        if (stats_ != nullptr) {
+            stats_->on_allocate(n * size_, n);
+        }
+        profile_allocation(n * size_);
+    }
+
+    // Free n chunks at once, splicing them onto the free list as one chain so
+    // the next allocate_bulk() of the same size gets them back in the same order
+    template <typename T>
+    void deallocate_bulk(T *const *ptrs, size_t n) {
+        if (stats_ != nullptr) {
+            stats_->on_deallocate(n * size_, n);
+        }
+
+        if constexpr (ThreadOwned) {
+            if (!is_owner()) {
+                if (n > 0) {
+                    // One push for the whole batch
+                    FreeChunk *next = nullptr;
+                    for (size_t i = n; i > 0; i--) {
+                        check_freeable(ptrs[i - 1]);
+                        next = new (static_cast<void *>(ptrs[i - 1])) FreeChunk{next};
+                        mark_free(next);
+                    }
+                    push_remote(next, reinterpret_cast<FreeChunk *>(static_cast<void *>(ptrs[n - 1])));
+                }
+                return;
+            }
+        }
+
+        push_chain(ptrs, n);
+        if (trim_threshold_ != 0 && empty_blocks_ > trim_threshold_) {
+            trim(trim_threshold_ / 2);
+        }
+    }
+
+    /* Grow to at least blocks blocks right away, e.g. at startup to a capacity
+       read from configuration, and keep that many empty blocks on trim() from
+       now on: the runtime counterpart of ReservedBlocks, which it replaces.
+       With prefault the pages of new blocks are faulted in as well, so the
+       first allocations out of them take no page faults. */
+    void reserve(size_t blocks, bool prefault = false) {
+        while (num_blocks_ < blocks) {
+            add_more_addresses(prefault);
+        }
+        reserved_blocks_ = blocks;
+    }
+
+    // Trim down to the blocks reserved with ReservedBlocks or reserve()
+    size_t trim() {
+        return trim(reserved_blocks_);
+    }
+
+    /* Return the memory of blocks that have no live chunks to the OS, keeping at
+       most keep_blocks of them around for future allocations. This walks the whole free list, so it is
+       meant to be called after a burst rather than on every deallocation.
+       Returns the number of blocks given back to the OS. */
+    size_t trim(size_t keep_blocks) {
+        if constexpr (ThreadOwned) {
+            drain_remote_frees();
+        }
+        if (empty_blocks_ <= keep_blocks) {
+            return 0;
+        }
+
+        // Mark the empty blocks beyond the ones we keep
+        size_t to_release = empty_blocks_ - keep_blocks;
+        for (auto block = blocks_; block != nullptr && to_release > 0; block = block->next) {
+            if (block->live == 0) {
+                block->live = kReleased;
+                to_release--;
+            }
+        }
+
+        // Drop their chunks from the free list, preserving the order of the rest
+        FreeChunk **link = &free_list_;
+        while (*link != nullptr) {
+            if (header(*link)->live == kReleased) {
+                *link = (*link)->next;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+
+        size_t released = 0;
+        BlockHeader **block_link = &blocks_;
+        while (*block_link != nullptr) {
+            auto block = *block_link;
+            if (block->live == kReleased) {
+                *block_link = block->next;
+                release_block(block_base(block));
+                released++;
+            } else {
+                block_link = &block->next;
+            }
+        }
+
+        num_blocks_ -= released;
+        empty_blocks_ -= released;
+        if (stats_ != nullptr) {
+            stats_->on_release(released * BlockSize);
+        }
+        return released;
+    }
+
+    /* Automatically trim once more than max_empty_blocks blocks are empty, down
+       to half that many, so a pool hovering around a block boundary does not
+       release and refault a block on every call. 0 (the default) disables automatic trimming. */
+    void set_trim_threshold(size_t max_empty_blocks) {
+        trim_threshold_ = max_empty_blocks;
+    }
+
+    size_t num_blocks() const {
+        return num_blocks_;
+    }
+
+    // The requested size rounded up to whole chunks of the Alignment
+    size_t chunk_size() const {
+        return size_;
+    }
+
+    int numa_node() const {
+        return numa_node_;
+    }
+
+    // The pool a chunk was allocated from
+    static Pool* owner(void *ptr) {
+        return header(ptr)->owner;
+    }
+
+    size_t empty_blocks() const {
+        return empty_blocks_;
+    }
+
+    // What backs the most recently mapped region, e.g. whether HugePages got
+    // huge pages from hugetlbfs or had to fall back to THP
+    PageBacking backing() const {
+        return last_backing_;
+    }
+
+    /* Hand a ThreadOwned pool over to another thread, e.g. when a worker takes
+       over the pools of one that exited. The previous owner must not use it
+       anymore. With no owner (a default std::thread::id) every free is a
+       remote free, so a pool whose allocations are serialized by a lock can
+       still be freed to without taking it. */
+    void set_owner(std::thread::id owner) {
+        static_assert(ThreadOwned, "Only ThreadOwned pools have an owner");
+        remote_.owner.store(owner, std::memory_order_relaxed);
+    }
+
+    std::thread::id owner_thread() const {
+        static_assert(ThreadOwned, "Only ThreadOwned pools have an owner");
+        return remote_.owner.load(std::memory_order_relaxed);
+    }
+
+    /* Move the chunks other threads freed so far onto the free list, which the
+       owner does on its own when its free list runs dry and before trim().
+       Returns how many there were. */
+    size_t drain_remote_frees() {
+        static_assert(ThreadOwned, "Only ThreadOwned pools have remote frees");
+        auto chunk = remote_.head.exchange(nullptr, std::memory_order_acquire);
+        if (chunk == nullptr) {
+            return 0;
+        }
+
+        BlockHeader *block = nullptr;
+        size_t run = 0;
+        size_t drained = 0;
+        auto first = chunk;
+        for (;; chunk = chunk->next) {
+            auto chunk_block = header(chunk);
+            if (chunk_block != block) {
+                remove_live(block, run);
+                block = chunk_block;
+                run = 0;
+            }
+            run++;
+            drained++;
+            if (chunk->next == nullptr) {
+                break;
+            }
+        }
+        remove_live(block, run);
+
+        chunk->next = free_list_;
+        free_list_ = first;
+        return drained;
+    }
+
+    /* Whether ptr points into memory of this pool, e.g. to catch a chunk being
+       freed to the wrong pool. A range check with a contiguous backing such as
+       ReservedRange, otherwise a scan of the regions. */
+    bool owns(const void *ptr) const {
+        if constexpr (Backing::kContiguous) {
+            return backing_.contains(ptr);
+        } else {
+            auto address = static_cast<const uint8_t *>(ptr);
+            return std::any_of(regions_.begin(), regions_.end(), [address](const auto& region) {
+                auto begin = static_cast<const uint8_t *>(region.first);
+                return address >= begin && address < begin + region.second;
+            });
+        }
+    }
+
+    /* Report to stats from now on, which must outlive the pool or be detached
+       with set_stats(nullptr). The blocks the pool already holds are counted
+       as reserved right away, chunks allocated before are not counted. */
+    void set_stats(AllocatorStats *stats) {
+        if (stats_ != nullptr) {
+            stats_->on_release(num_blocks_ * BlockSize);
+        }
+        stats_ = stats;
+        if (stats_ != nullptr) {
+            stats_->on_reserve(num_blocks_ * BlockSize);
+        }
+    }
+
+    AllocatorStats* stats() const {
+        return stats_;
+    }
+
+private:
+    static BlockHeader* header(void *ptr) {
+        auto base = reinterpret_cast<uintptr_t>(ptr) & ~(uintptr_t{BlockSize} - 1);
+        return reinterpret_cast<BlockHeader *>(base + BlockSize - sizeof(BlockHeader));
+    }
+
+    // Hardened builds only: free chunks carry a canary after the link and
+    // kFreePattern in the rest, checked when they are handed out again
+    void mark_free(FreeChunk *chunk) {
+        if constexpr (hardening::kEnabled) {
+            const auto canary = hardening::free_canary(chunk);
+            memcpy(reinterpret_cast<uint8_t *>(chunk) + sizeof(FreeChunk), &canary, sizeof(canary));
+            hardening::fill_freed(chunk, size_, kPoolFreeChunkSize);
+        }
+    }
+
+    void check_free(FreeChunk *chunk) {
+        if constexpr (hardening::kEnabled) {
+            if (canary(chunk) != hardening::free_canary(chunk)) {
+                hardening::fail("free chunk was written to (use after free)", chunk);
+            }
+            hardening::check_freed(chunk, size_, kPoolFreeChunkSize);
+
+            const uintptr_t cleared = 0;
+            memcpy(reinterpret_cast<uint8_t *>(chunk) + sizeof(FreeChunk), &cleared, sizeof(cleared));
+        }
+    }
+
+    // A live chunk of this pool, not one that is free already or of another pool
+    void check_freeable(void *ptr) {
+        if constexpr (hardening::kEnabled) {
+            if (owner(ptr) != this) {
+                hardening::fail("chunk freed to a pool it was not allocated from", ptr);
+            }
+            if (canary(ptr) == hardening::free_canary(ptr)) {
+                hardening::fail("double free", ptr);
+            }
+        }
+    }
+
+    static uintptr_t canary(const void *chunk) {
+        uintptr_t canary;
+        memcpy(&canary, static_cast<const uint8_t *>(chunk) + sizeof(FreeChunk), sizeof(canary));
+        return canary;
+    }
+
+    bool is_owner() const {
+        return remote_.owner.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+    // Push the chain [first, last] onto the remote-free list. Pushes only race
+    // with each other and with the owner taking the whole list, so there is no ABA.
+    void push_remote(FreeChunk *first, FreeChunk *last) {
+        auto head = remote_.head.load(std::memory_order_relaxed);
+        do {
+            last->next = head;
+        } while (!remote_.head.compare_exchange_weak(head, first, std::memory_order_release,
+                                                     std::memory_order_relaxed));
+    }
+
+    // Chunks freed by other threads are put to use before the pool grows
+    void refill() {
+        if constexpr (ThreadOwned) {
+            if (drain_remote_frees() > 0) {
+                return;
+            }
+        }
+        add_more_addresses();
+    }
+
+    // Take up to n chunks off the free list, returns how many
+    template <typename T>
+    size_t pop_chain(size_t n, T **out) {
+        BlockHeader *block = nullptr;
+        size_t run = 0;
+        size_t i = 0;
+        for (; i < n && free_list_ != nullptr; i++) {
+            auto chunk = free_list_;
+            check_free(chunk);
+            free_list_ = chunk->next;
+            out[i] = static_cast<T *>(static_cast<void *>(chunk));
+
+            auto chunk_block = header(chunk);
+            if (chunk_block != block) {
+                add_live(block, run);
+                block = chunk_block;
+                run = 0;
+            }
+            run++;
+        }
+        add_live(block, run);
+        return i;
+    }
+
+    // Link the chunks to each other and put the chain in front of the free list
+    template <typename T>
+    void push_chain(T *const *ptrs, size_t n) {
+        if (n == 0) {
+            return;
+        }
+
+        BlockHeader *block = nullptr;
+        size_t run = 0;
+        FreeChunk *next = free_list_;
+        for (size_t i = n; i > 0; i--) {
+            void *ptr = ptrs[i - 1];
+            check_freeable(ptr);
+            next = new (ptr) FreeChunk{next};
+            mark_free(next);
+
+            auto chunk_block = header(ptr);
+            if (chunk_block != block) {
+                remove_live(block, run);
+                block = chunk_block;
+                run = 0;
+            }
+            run++;
+        }
+        remove_live(block, run);
+        free_list_ = next;
+    }
+
+    void add_live(BlockHeader *block, size_t count) {
+        if (count != 0) {
+            if (block->live == 0) {
+                empty_blocks_--;
+            }
+            block->live += count;
+        }
+    }
+
+    void remove_live(BlockHeader *block, size_t count) {
+        if (count != 0) {
+            block->live -= count;
+            if (block->live == 0) {
+                empty_blocks_++;
+            }
+        }
+    }
+
+    // Give the pages of a block back to the OS but keep its address range mapped,
+    // so it can be handed out again without another mmap. Blocks smaller than a
+    // page share their pages with other blocks, which may still be live, so
+    // those are only kept for reuse.
+    void release_block(uint8_t *block) {
+        if (BlockSize >= Backing::page_size()) {
+            backing_.release(block, BlockSize);
+        }
+        released_.push_back(block);
+    }
+
+    // Blocks are carved out of regions that double in size up to kMaxRegionBlocks
+    // (or one page of the backing, if larger),
+    // so a growing pool does not pay an mmap call for every block. Released blocks
+    // are reused first.
+    uint8_t* next_block() {
+        if (!released_.empty()) {
+            auto block = released_.back();
+            released_.pop_back();
+            return block;
+        }
+
+        if (spare_blocks_ == 0) {
+            const auto region_size = region_blocks_ * BlockSize;
+            spare_ = static_cast<uint8_t *>(
+                backing_.map(region_size, std::max(BlockSize, Backing::page_size()), last_backing_));
+            if (spare_ == nullptr) {
+                throw std::bad_alloc();
+            }
+            if (numa_node_ >= 0) {
+                numa_prefer_node(spare_, region_size, numa_node_);
+            }
+            spare_blocks_ = region_blocks_;
+            regions_.emplace_back(spare_, region_size);
+            region_blocks_ = std::min(2 * region_blocks_, max_region_blocks_);
+        }
+
+        auto block = spare_;
+        spare_ += BlockSize;
+        spare_blocks_--;
+        return block;
+    }
+
+    static uint8_t* block_base(BlockHeader *block) {
+        return reinterpret_cast<uint8_t *>(block) + sizeof(BlockHeader) - BlockSize;
+    }
+
+    // Refill the free list by allocating another block of memory
+    void add_more_addresses(bool populate = false) {
+        const auto num_chunks = chunks_per_block_;
+        if (num_chunks == 0) {
+            throw std::bad_alloc();
+        }
+
+        auto block = next_block();
+        if (populate) {
+            prefault(block, BlockSize);
+        }
+        auto block_header = new (header(block)) BlockHeader{blocks_, 0, this};
+
+        // Divide the allocated block into chunks of size_ bytes, and thread them onto
+        // the free list in address order so consecutive allocations are adjacent
+        for (size_t i = num_chunks; i > 0; i--) {
+            free_list_ = new (&block[(i - 1) * size_]) FreeChunk{free_list_};
+            mark_free(free_list_);
+        }
+
+        // Keep track of the block so it can be trimmed or unmapped on destruction
+        blocks_ = block_header;
+        num_blocks_++;
+        empty_blocks_++;
+        if (stats_ != nullptr) {
+            stats_->on_reserve(BlockSize);
+        }
+    }
+};
+
+// One Pool per NUMA node. Chunks come from the pool of the calling thread's node
+// and go back to the pool they came from, whichever thread frees them. Each
+// node's pool has its own lock, so only threads on the same node contend.
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t Alignment = alignof(void *),
+          typename Backing = BasePages>
+class NumaPool {
+private:
+    using PoolType = Pool<BlockSize, ReservedBlocks, Alignment, Backing>;
+
+    struct alignas(64) Node {
+        std::mutex mutex;
+        PoolType pool;
+
+        Node(size_t size, int node) : pool(size, node) {}
+    };
+
+    std::vector<std::unique_ptr<Node>> nodes_;
+
+public:
+    explicit NumaPool(size_t size) {
+        for (int node = 0; node < numa_num_nodes(); node++) {
+            nodes_.push_back(std::make_unique<Node>(size, node));
+        }
+    }
+
+    void* allocate() {
+        auto& node = *nodes_[numa_current_node() % nodes_.size()];
+        std::scoped_lock<std::mutex> lock(node.mutex);
+        return node.pool.allocate();
+    }
+
+    void deallocate(void *ptr) {
+        auto& node = *nodes_[PoolType::owner(ptr)->numa_node()];
+        std::scoped_lock<std::mutex> lock(node.mutex);
+        node.pool.deallocate(ptr);
+    }
+
+    // All n chunks come from the calling thread's node, under one lock
+    template <typename T>
+    void allocate_bulk(size_t n, T **out) {
+        auto& node = *nodes_[numa_current_node() % nodes_.size()];
+        std::scoped_lock<std::mutex> lock(node.mutex);
+        node.pool.allocate_bulk(n, out);
+    }
+
+    // Each run of chunks from the same node goes back under one lock
+    template <typename T>
+    void deallocate_bulk(T *const *ptrs, size_t n) {
+        for (size_t i = 0; i < n;) {
+            auto owner = PoolType::owner(ptrs[i]);
+            size_t run = 1;
+            while (i + run < n && PoolType::owner(ptrs[i + run]) == owner) {
+                run++;
+            }
+
+            auto& node = *nodes_[owner->numa_node()];
+            std::scoped_lock<std::mutex> lock(node.mutex);
+            node.pool.deallocate_bulk(ptrs + i, run);
+            i += run;
+        }
+    }
+
+    // Spread over the nodes, each node's pool gets its share of the blocks
+    void reserve(size_t blocks, bool prefault = false) {
+        const auto per_node = (blocks + nodes_.size() - 1) / nodes_.size();
+        for (auto& node : nodes_) {
+            std::scoped_lock<std::mutex> lock(node->mutex);
+            node->pool.reserve(per_node, prefault);
+        }
+    }
+
+    PoolType& node_pool(int node) {
+        return nodes_[node]->pool;
+    }
+
+    // All node pools report to the same stats
+    void set_stats(AllocatorStats *stats) {
+        for (auto& node : nodes_) {
+            std::scoped_lock<std::mutex> lock(node->mutex);
+            node->pool.set_stats(stats);
+        }
+    }
+
+    AllocatorStats* stats() const {
+        return nodes_.front()->pool.stats();
+    }
+};
+
+// Pools backed by 2 MiB huge pages, as the PoolTemplate of a PoolAllocator
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t Alignment = alignof(void *)>
+using HugePagePool = Pool<BlockSize, ReservedBlocks, Alignment, HugePages<>>;
+
+// Reserved hugetlbfs pages, falling back to THP
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t Alignment = alignof(void *)>
+using HugeTLBPool = Pool<BlockSize, ReservedBlocks, Alignment, HugePages<1 << 21, HugePageMode::HugeTLB>>;
+
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t Alignment = alignof(void *)>
+using HugePageNumaPool = NumaPool<BlockSize, ReservedBlocks, Alignment, HugePages<>>;
+
+// Pools whose blocks are all adjacent in 4 GiB of address space reserved per pool
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t Alignment = alignof(void *)>
+using ReservedPool = Pool<BlockSize, ReservedBlocks, Alignment, ReservedRange<>>;
+
+// Pools of one thread that any thread may free to, see Pool
+template <size_t BlockSize, size_t ReservedBlocks = 0, size_t Alignment = alignof(void *)>
+using ThreadOwnedPool = Pool<BlockSize, ReservedBlocks, Alignment, BasePages, true>;
+
+/* The pools behind a PoolAllocator and all of its copies and rebound copies:
+   one pool per chunk size and block size, shared by every type that maps to
+   it, plus power-of-two size classes for arrays (n > 1) up to kMaxArraySize.
+   A node-based container can rebind to as many internal types as it likes,
+   e.g. the nodes and the bucket array of a std::unordered_map, each one
+   simply gets the pool for its size. Array classes above kMaxSmallArraySize
+   come from huge-page sized blocks, which still hold 7 of the largest. */
+template <size_t ReservedBlocks = 0, template <size_t, size_t, size_t> class PoolTemplate = Pool>
+class PoolRegistry {
+public:
+    static constexpr size_t kMinArraySize = 16;
+    static constexpr size_t kMaxSmallArraySize = 2048;
+    static constexpr size_t kMaxArraySize = 256 << 10;
+    static constexpr size_t kArrayBlockSize = 1 << 16;
+    static constexpr size_t kLargeArrayBlockSize = 1 << 21;
+
+private:
+    static constexpr size_t kNumSmallArrayClasses = 8;
+    static constexpr size_t kNumArrayClasses = 15;
+    static_assert(kMinArraySize << (kNumSmallArrayClasses - 1) == kMaxSmallArraySize,
+                  "small array classes must cover [kMinArraySize, kMaxSmallArraySize]");
+    static_assert(kMinArraySize << (kNumArrayClasses - 1) == kMaxArraySize, "array classes must cover [kMinArraySize, kMaxArraySize]");
+
+    // The pools have different types for different block sizes, so they are
+    // stored type-erased along with how to attach stats to them
+    struct Entry {
+        std::shared_ptr<void> pool;
+        void (*set_stats)(void *pool, AllocatorStats *stats);
+    };
+
+    std::mutex mutex_;
+    // Keyed by block size, reserved blocks, alignment and chunk size
+    std::map<std::tuple<size_t, size_t, size_t, size_t>, Entry> pools_;
+    // The pools of the array classes, created on first use, see array_pool()
+    std::array<std::atomic<void *>, kNumArrayClasses> arrays_{};
+    AllocatorStats *stats_ = nullptr;
+
+public:
+    PoolRegistry() = default;
+
+    PoolRegistry(const PoolRegistry&) = delete;
+    PoolRegistry& operator=(const PoolRegistry&) = delete;
+
+    // The pool for chunks of chunk_size bytes in blocks of BlockSize bytes,
+    // created on first use. The reference stays valid as long as the registry.
+    template <size_t BlockSize, size_t Reserved = ReservedBlocks, size_t Alignment = alignof(void *)>
+    PoolTemplate<BlockSize, Reserved, Alignment>& pool(size_t chunk_size) {
+        using PoolType = PoolTemplate<BlockSize, Reserved, Alignment>;
+
+        std::scoped_lock<std::mutex> lock(mutex_);
+        auto& entry = pools_[{BlockSize, Reserved, Alignment, chunk_size}];
+        if (entry.pool == nullptr) {
+            auto pool = std::make_shared<PoolType>(chunk_size);
+            pool->set_stats(stats_);
+            entry.pool = pool;
+            entry.set_stats = [](void *pool, AllocatorStats *stats) {
+                static_cast<PoolType *>(pool)->set_stats(stats);
+            };
+        }
+
+        return *static_cast<PoolType *>(entry.pool.get());
+    }
+
+    // bytes must not exceed kMaxArraySize. Chunks are aligned to their class
+    // size, since power-of-two chunks in a BlockSize-aligned block are.
+    void* allocate_array(size_t bytes) {
+        const auto index = array_class(bytes);
+        if (index < kNumSmallArrayClasses) {
+            return array_pool<kArrayBlockSize>(index).allocate();
+        }
+        return array_pool<kLargeArrayBlockSize>(index).allocate();
+    }
+
+    void deallocate_array(void *ptr, size_t bytes) {
+        const auto index = array_class(bytes);
+        if (index < kNumSmallArrayClasses) {
+            array_pool<kArrayBlockSize>(index).deallocate(ptr);
+        } else {
+            array_pool<kLargeArrayBlockSize>(index).deallocate(ptr);
+        }
+    }
+
+    // Every pool, including the ones created later, reports to stats
+    void set_stats(AllocatorStats *stats) {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        stats_ = stats;
+        for (auto& [key, entry] : pools_) {
+            entry.set_stats(entry.pool.get(), stats);
+        }
+    }
+
+    AllocatorStats* stats() const {
+        return stats_;
+    }
+
+private:
+    // Only creating a class's pool takes the lock (in pool()), every later
+    // lookup is a load
+    template <size_t BlockSize>
+    PoolTemplate<BlockSize, 0, kMinArraySize>& array_pool(size_t index) {
+        using PoolType = PoolTemplate<BlockSize, 0, kMinArraySize>;
+
+        auto cached = arrays_[index].load(std::memory_order_acquire);
+        if (cached == nullptr) {
+            cached = &pool<BlockSize, 0, kMinArraySize>(kMinArraySize << index);
+            arrays_[index].store(cached, std::memory_order_release);
+        }
+        return *static_cast<PoolType *>(cached);
+    }
+
+    static size_t array_class(size_t bytes) {
+        if (bytes <= kMinArraySize) {
+            return 0;
+        }
+
+        // Index of the smallest power of two >= bytes, relative to kMinArraySize
+        return 64 - __builtin_clzll(bytes - 1) - __builtin_ctzll(kMinArraySize);
+    }
+};
+
+/* PoolTemplate selects the pool implementation, e.g. NumaPool or HugePagePool. The default
+   BlockSize of 0 derives the block size from T with PoolGeometry, and so does
+   every rebound copy for its own type, e.g. the node type of a std::list.
+   Arrays of up to PoolRegistry::kMaxArraySize bytes are pooled as well. Larger
+   ones are left to malloc: there is no bound on their size to build classes for. Every allocation is aligned to at least
+   Alignment bytes, see CacheAlignedPoolAllocator. */
+template <typename T, size_t BlockSize = 0, size_t ReservedBlocks = 0,
+          template <size_t, size_t, size_t> class PoolTemplate = Pool, size_t Alignment = alignof(T)>
+class PoolAllocator {
+private:
+    template <typename U, size_t, size_t, template <size_t, size_t, size_t> class, size_t>
+    friend class PoolAllocator;
+
+    // Never align below what T itself requires
+    static constexpr size_t kAlignment = std::max(Alignment, alignof(T));
+
+    using Geometry = PoolGeometry<sizeof(T), kAlignment, BlockSize>;
+    static_assert(Geometry::kChunksPerBlock > 0, "T does not fit in a block of BlockSize bytes");
+
+    using Registry = PoolRegistry<ReservedBlocks, PoolTemplate>;
+    using PoolType = PoolTemplate<Geometry::kBlockSize, ReservedBlocks, std::max(kAlignment, alignof(void *))>;
+    std::shared_ptr<Registry> registry_;
+    PoolType *pool_;
+
+public:
+    using value_type = T;
+    using is_always_equal = std::false_type;
+
+    PoolAllocator() : PoolAllocator(std::make_shared<Registry>()) {}
+
+    explicit PoolAllocator(std::shared_ptr<Registry> registry)
+        : registry_(std::move(registry)),
+          pool_(&registry_->template pool<Geometry::kBlockSize, ReservedBlocks, std::max(kAlignment, alignof(void *))>(
+              Geometry::kChunkSize)) {}
+
+    // Rebind copy constructor
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, BlockSize, ReservedBlocks, PoolTemplate, Alignment>& other)
+        : PoolAllocator(other.registry_) {}
+
+    template <typename U>
+    struct rebind {
+        using other = PoolAllocator<U, BlockSize, ReservedBlocks, PoolTemplate, Alignment>;
+    };
+
+    PoolAllocator(const PoolAllocator& other) = default;
+    PoolAllocator(PoolAllocator&& other) = default;
+    PoolAllocator& operator=(const PoolAllocator& other) = default;
+    PoolAllocator& operator=(PoolAllocator&& other) = default;
+
+    T* allocate(size_t n) {
+        if (n == 1) {
+            return static_cast<T*>(pool_->allocate());
+        }
+
+        if (n > (std::numeric_limits<size_t>::max() - kAlignment) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+
+        const auto bytes = array_size(n);
+        if (bytes <= Registry::kMaxArraySize) {
+            return static_cast<T*>(registry_->allocate_array(bytes));
+        }
+
+        // Only arrays too large for the array classes resort to using malloc
+        if (auto stats = registry_->stats()) {
+            stats->on_fallback_allocate(bytes);
+        }
+        auto ptr = kAlignment > alignof(std::max_align_t) ? aligned_alloc(kAlignment, bytes) : malloc(bytes);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (n == 1) {
+            pool_->deallocate(ptr);
+            return;
+        }
+
+        const auto bytes = array_size(n);
+        if (bytes <= Registry::kMaxArraySize) {
+            registry_->deallocate_array(ptr, bytes);
+            return;
+        }
+
+        if (auto stats = registry_->stats()) {
+            stats->on_fallback_deallocate(bytes);
+        }
+        free(ptr);
+    }
+
+    // n single objects at once, e.g. the nodes of a batch of messages. Each of
+    // them is freed with deallocate(ptr, 1) or all together with deallocate_bulk().
+    void allocate_bulk(size_t n, T **out) {
+        pool_->allocate_bulk(n, out);
+    }
+
+    void deallocate_bulk(T *const *ptrs, size_t n) {
+        pool_->deallocate_bulk(ptrs, n);
+    }
+
+    /* Make room for n objects of T now, see Pool::reserve(). The pool is that of
+       T's size, so reserve for the nodes of a container through an allocator of
+       a type of the same size and alignment as the node, which shares the pool. */
+    void reserve(size_t n, bool prefault = false) {
+        pool_->reserve((n + Geometry::kChunksPerBlock - 1) / Geometry::kChunksPerBlock, prefault);
+    }
+
+    // Shared by all copies and rebound copies, like the pools
+    void set_stats(AllocatorStats *stats) {
+        registry_->set_stats(stats);
+    }
+
+    AllocatorStats* stats() const {
+        return registry_->stats();
+    }
+
+    const std::shared_ptr<Registry>& registry() const {
+        return registry_;
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U, BlockSize, ReservedBlocks, PoolTemplate, Alignment>& other) const {
+        return registry_ == other.registry_;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U, BlockSize, ReservedBlocks, PoolTemplate, Alignment>& other) const {
+        return registry_ != other.registry_;
+    }
+
+private:
+    // Array classes are aligned to their size, so an array takes at least a
+    // class of kAlignment bytes. aligned_alloc() wants a multiple of it as well.
+    static size_t array_size(size_t n) {
+        const auto bytes = std::max(sizeof(T) * n, kAlignment);
+        return (bytes + kAlignment - 1) & ~(kAlignment - 1);
+    }
+};
+
+// Pooled objects that each start on a cache line (or an Alignment of 32/64 for
+// AVX/AVX-512 data), the pooled counterpart of CacheAlignedAllocator
+template <typename T, size_t Alignment = 64, size_t BlockSize = 0>
+using CacheAlignedPoolAllocator = PoolAllocator<T, BlockSize, 0, Pool, Alignment>;
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sched.h>
+#include <sys/sysinfo.h>
+#include "cache_aligned_allocator.h"
+
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define SHARDED_HAVE_RSEQ 1
+#endif
+
+/* The CPU the calling thread runs on. glibc 2.35+ registers an rseq area for
+   every thread, in which the kernel keeps the current CPU up to date, so this
+   is a load relative to the thread pointer. Without rseq it is sched_getcpu(),
+   a vDSO call. The thread may be migrated right after either returns. */
+inline unsigned current_cpu() {
+#if defined(SHARDED_HAVE_RSEQ)
+    if (__rseq_size > 0) {
+        auto area = reinterpret_cast<const volatile struct rseq *>(
+            static_cast<const char *>(__builtin_thread_pointer()) + __rseq_offset);
+        int32_t cpu = area->cpu_id;
+        if (cpu >= 0) {
+            return cpu;
+        }
+    }
+#endif
+    int cpu = sched_getcpu();
+    return cpu >= 0 ? cpu : 0;
+}
+
+/* One T per CPU, each on its own Alignment-sized slot of a padded_vector, for
+   metrics and reference counts that are updated far more often than read.
+   local() is the slot of the current CPU, readers combine all of them, e.g.
+
+       sharded<std::atomic<uint64_t>> requests;
+       requests.local().fetch_add(1, std::memory_order_relaxed);
+       uint64_t total = 0;
+       for (auto& slot : requests) total += slot->load(std::memory_order_relaxed);
+
+   A thread can be migrated between picking a slot and updating it, so two
+   threads may hit the same slot now and then: T must still be safe to update
+   concurrently (an atomic), it is just rarely contended. */
+template <typename T, size_t Alignment = 64>
+class sharded {
+private:
+    padded_vector<T, Alignment> slots_;
+
+public:
+    // A slot for every configured CPU, including ones that are offline now
+    sharded() : sharded(get_nprocs_conf()) {}
+
+    explicit sharded(size_t num_slots) : slots_(std::max<size_t>(num_slots, 1)) {}
+
+    sharded(const sharded&) = delete;
+    sharded& operator=(const sharded&) = delete;
+
+    T& local() {
+        return *slots_[current_cpu() % slots_.size()];
+    }
+
+    T& operator[](size_t i) {
+        return *slots_[i];
+    }
+
+    const T& operator[](size_t i) const {
+        return *slots_[i];
+    }
+
+    size_t size() const {
+        return slots_.size();
+    }
+
+    // Iterate over the cache_padded<T> slots
+    auto begin() { return slots_.begin(); }
+    auto end() { return slots_.end(); }
+    auto begin() const { return slots_.begin(); }
+    auto end() const { return slots_.end(); }
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <new>
+#include <limits>
+#include <utility>
+#include "pool_allocator.h"
+
+// Routes each request to a Pool serving the smallest power-of-two size class that
+// fits it (8, 16, ..., kMaxSize bytes). Larger requests fall back to malloc.
+template <size_t BlockSize = 1 << 16>
+class SizeClassPool {
+public:
+    static constexpr size_t kMinSize = 8;
+    static constexpr size_t kMaxSize = 2048;
+    static constexpr size_t kNumClasses = 9;
+
+private:
+    using PoolType = Pool<BlockSize>;
+    std::array<PoolType, kNumClasses> pools_;
+    AllocatorStats *stats_ = nullptr;
+
+    static_assert(kMinSize << (kNumClasses - 1) == kMaxSize, "size classes must cover [kMinSize, kMaxSize]");
+    static_assert(BlockSize % kMaxSize == 0, "BlockSize must hold a whole number of the largest chunks");
+
+public:
+    SizeClassPool() : pools_(make_pools(std::make_index_sequence<kNumClasses>{})) {}
+
+    void* allocate(size_t size) {
+        if (size > kMaxSize) {
+            auto ptr = malloc(size);
+            if (ptr == nullptr) {
+                throw std::bad_alloc();
+            }
+            if (stats_ != nullptr) {
+                stats_->on_fallback_allocate(size);
+            }
+            return ptr;
+        }
+
+        return pools_[class_index(size)].allocate();
+    }
+
+    // size must be the same as the one passed to allocate()
+    void deallocate(void *ptr, size_t size) {
+        if (size > kMaxSize) {
+            if (stats_ != nullptr) {
+                stats_->on_fallback_deallocate(size);
+            }
+            free(ptr);
+            return;
+        }
+
+        pools_[class_index(size)].deallocate(ptr);
+    }
+
+    // Trim the empty blocks of every size class, returns the number released
+    size_t trim() {
+        size_t released = 0;
+        for (auto& pool : pools_) {
+            released += pool.trim();
+        }
+        return released;
+    }
+
+    void set_trim_threshold(size_t max_empty_blocks) {
+        for (auto& pool : pools_) {
+            pool.set_trim_threshold(max_empty_blocks);
+        }
+    }
+
+    // Every size class and the malloc fallback report to the same stats. Chunks
+    // are counted with the size of their class, not the size requested.
+    void set_stats(AllocatorStats *stats) {
+        stats_ = stats;
+        for (auto& pool : pools_) {
+            pool.set_stats(stats);
+        }
+    }
+
+    AllocatorStats* stats() const {
+        return stats_;
+    }
+
+    static constexpr size_t class_size(size_t index) {
+        return kMinSize << index;
+    }
+
+    static size_t class_index(size_t size) {
+        if (size <= kMinSize) {
+            return 0;
+        }
+
+        // Index of the smallest power of two >= size, relative to kMinSize
+        return 64 - __builtin_clzll(size - 1) - 3;
+    }
+
+private:
+    template <size_t... Is>
+    static std::array<PoolType, kNumClasses> make_pools(std::index_sequence<Is...>) {
+        return {{PoolType(class_size(Is))...}};
+    }
+};
+
+// Unlike PoolAllocator, any n is served from the pools, so array allocations
+// (std::vector, std::string, hash table buckets) are pooled as well. All rebound
+// copies share the same SizeClassPool.
+template <typename T, size_t BlockSize = 1 << 16>
+class SizeClassAllocator {
+private:
+    template <typename U, size_t>
+    friend class SizeClassAllocator;
+
+    using PoolType = SizeClassPool<BlockSize>;
+    std::shared_ptr<PoolType> pool_;
+
+public:
+    using value_type = T;
+    using is_always_equal = std::false_type;
+
+    SizeClassAllocator() : pool_(std::make_shared<PoolType>()) {}
+
+    // Rebind copy constructor
+    template <typename U>
+    SizeClassAllocator(const SizeClassAllocator<U, BlockSize>& other) : pool_{other.pool_} {}
+
+    template <typename U>
+    struct rebind {
+        using other = SizeClassAllocator<U, BlockSize>;
+    };
+
+    SizeClassAllocator(const SizeClassAllocator& other) = default;
+    SizeClassAllocator(SizeClassAllocator&& other) = default;
+    SizeClassAllocator& operator=(const SizeClassAllocator& other) = default;
+    SizeClassAllocator& operator=(SizeClassAllocator&& other) = default;
+
+    T* allocate(size_t n) {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+
+        return static_cast<T*>(pool_->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        pool_->deallocate(ptr, sizeof(T) * n);
+    }
+
+    void set_stats(AllocatorStats *stats) {
+        pool_->set_stats(stats);
+    }
+
+    AllocatorStats* stats() const {
+        return pool_->stats();
+    }
+
+    template <typename U>
+    bool operator==(const SizeClassAllocator<U, BlockSize>& other) const {
+        return pool_ == other.pool_;
+    }
+
+    template <typename U>
+    bool operator!=(const SizeClassAllocator<U, BlockSize>& other) const {
+        return pool_ != other.pool_;
+    }
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+// Lock-free (Treiber) stack of nodes linked through their std::atomic<Node *>
+// next member. The head packs a 16-bit version tag into the unused upper bits
+// of the pointer (48-bit virtual addresses), so a node popped and pushed back
+// between our load and CAS does not cause ABA. Nodes must outlive the stack:
+// pop() reads next of a node another thread may have popped meanwhile.
+template <typename Node>
+class TaggedStack {
+private:
+    static constexpr int kTagShift = 48;
+    static constexpr uint64_t kPtrMask = (uint64_t{1} << kTagShift) - 1;
+    std::atomic<uint64_t> head_{0};
+
+    static Node* ptr(uint64_t head) {
+        return reinterpret_cast<Node *>(head & kPtrMask);
+    }
+
+    static uint64_t pack(Node *node, uint64_t prev_head) {
+        auto tag = (prev_head >> kTagShift) + 1;
+        return reinterpret_cast<uint64_t>(node) | (tag << kTagShift);
+    }
+
+public:
+    void push(Node *node) {
+        auto head = head_.load(std::memory_order_relaxed);
+        do {
+            node->next.store(ptr(head), std::memory_order_relaxed);
+        } while (!head_.compare_exchange_weak(head, pack(node, head),
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+    }
+
+    Node* pop() {
+        auto head = head_.load(std::memory_order_acquire);
+        Node *node;
+        do {
+            node = ptr(head);
+            if (node == nullptr) {
+                return nullptr;
+            }
+        } while (!head_.compare_exchange_weak(head, pack(node->next.load(std::memory_order_relaxed), head),
+                                              std::memory_order_acquire,
+                                              std::memory_order_acquire));
+        return node;
+    }
+};
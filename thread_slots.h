@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <bitset>
+
+// Hands out small integer ids to threads so that per-thread state (the caches of
+// a ConcurrentPool, the counters of AllocatorStats) can be indexed with them. Ids
+// are recycled when a thread exits, and the next thread to take an id inherits
+// what is stored under it, e.g. the cached magazines, so nothing leaks.
+// Threads beyond kMaxThreads all share the overflow id.
+class ThreadSlots {
+public:
+    static constexpr size_t kMaxThreads = 256;
+    static constexpr size_t kOverflow = kMaxThreads;
+
+    static size_t id() {
+        thread_local Slot slot;
+        return slot.id;
+    }
+
+private:
+    struct Slot {
+        size_t id = kOverflow;
+
+        Slot() {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < kMaxThreads; i++) {
+                if (!used_[i]) {
+                    used_[i] = true;
+                    id = i;
+                    break;
+                }
+            }
+        }
+
+        ~Slot() {
+            if (id != kOverflow) {
+                std::scoped_lock<std::mutex> lock(mutex_);
+                used_[id] = false;
+            }
+        }
+    };
+
+    static inline std::mutex mutex_;
+    static inline std::bitset<kMaxThreads> used_;
+};
@@ -0,0 +1,545 @@
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+#include "benchmark_util.h"
+#include "pool_allocator.h"
+#include "size_class_allocator.h"
+#include "concurrent_pool_allocator.h"
+#include "arena_allocator.h"
+
+// BENCHMARK CODE
+
+/* Multi-threaded workloads closer to what a service does to its allocator than
+   filling a single list: objects freed by another thread than the one that
+   allocated them, random sizes, long-lived objects mixed with short-lived ones
+   and fragmentation. Every workload runs against each backend below with 1 up
+   to hardware_concurrency threads, which are started inside the timed region. */
+
+namespace {
+
+// Backends share one interface: thread safe allocate(size) / deallocate(ptr, size),
+// and reset(), called once no thread is running and nothing is live anymore
+
+struct MallocBackend {
+    void* allocate(size_t size) {
+        return malloc(size);
+    }
+
+    void deallocate(void *ptr, size_t size) {
+        (void) size;
+        free(ptr);
+    }
+
+    void reset() {}
+};
+
+// The single-threaded size class pools behind one lock
+class LockedSizeClassBackend {
+private:
+    std::mutex mutex_;
+    SizeClassPool<> pool_;
+
+public:
+    void* allocate(size_t size) {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        return pool_.allocate(size);
+    }
+
+    void deallocate(void *ptr, size_t size) {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        pool_.deallocate(ptr, size);
+    }
+
+    void reset() {}
+};
+
+// One thread safe fixed-size pool per size class of SizeClassPool, e.g. NumaPool
+template <typename PoolType>
+class SizeClassBackend {
+private:
+    using Classes = SizeClassPool<>;
+    std::array<std::unique_ptr<PoolType>, Classes::kNumClasses> pools_;
+
+public:
+    SizeClassBackend() {
+        for (size_t i = 0; i < pools_.size(); i++) {
+            pools_[i] = std::make_unique<PoolType>(Classes::class_size(i));
+        }
+    }
+
+    void* allocate(size_t size) {
+        if (size > Classes::kMaxSize) {
+            return malloc(size);
+        }
+
+        return pools_[Classes::class_index(size)]->allocate();
+    }
+
+    void deallocate(void *ptr, size_t size) {
+        if (size > Classes::kMaxSize) {
+            free(ptr);
+            return;
+        }
+
+        pools_[Classes::class_index(size)]->deallocate(ptr);
+    }
+
+    void reset() {}
+};
+
+// A ConcurrentPoolAllocator of bytes, so objects are byte arrays from the
+// array classes of its registry, all of them ConcurrentPools
+class ConcurrentBackend {
+private:
+    ConcurrentPoolAllocator<uint8_t, 1 << 16> alloc_;
+
+public:
+    void* allocate(size_t size) {
+        return alloc_.allocate(size);
+    }
+
+    void deallocate(void *ptr, size_t size) {
+        alloc_.deallocate(static_cast<uint8_t *>(ptr), size);
+    }
+
+    void reset() {}
+};
+
+/* One set of size class pools per thread, owned by it: allocations never
+   contend, and a free goes back to the pool the chunk came from, directly if
+   it is the caller's own or onto its remote-free list otherwise. A thread that
+   takes over the slot of one that exited takes over its pools. Overflow
+   threads share pools without an owner, allocating under a lock. */
+class ThreadOwnedBackend {
+private:
+    using Classes = SizeClassPool<>;
+    using PoolType = ThreadOwnedPool<1 << 16>;
+    using Pools = std::array<std::unique_ptr<PoolType>, Classes::kNumClasses>;
+
+    /* Clears the owner of the pools of an exiting thread, as its id can be
+       reused by a new thread in another slot, which would then free to them
+       as their owner. Destroyed before the ThreadSlots slot is released, and
+       zero-initialized like any thread_local, so unset until a pool is owned. */
+    struct OwnerReleaser {
+        ThreadOwnedBackend *backend;
+        size_t id;
+
+        ~OwnerReleaser() {
+            if (backend != nullptr) {
+                backend->release_owner(id);
+            }
+        }
+    };
+
+    static inline thread_local OwnerReleaser releaser_;
+
+    std::array<std::unique_ptr<Pools>, ThreadSlots::kMaxThreads + 1> threads_;
+    std::mutex overflow_mutex_;
+
+public:
+    ThreadOwnedBackend() = default;
+    ThreadOwnedBackend(const ThreadOwnedBackend&) = delete;
+    ThreadOwnedBackend& operator=(const ThreadOwnedBackend&) = delete;
+
+    // Workers are joined before, only the thread destroying it can still refer to it
+    ~ThreadOwnedBackend() {
+        if (releaser_.backend == this) {
+            releaser_.backend = nullptr;
+        }
+    }
+
+    void* allocate(size_t size) {
+        if (size > Classes::kMaxSize) {
+            return malloc(size);
+        }
+
+        auto id = ThreadSlots::id();
+        if (id == ThreadSlots::kOverflow) {
+            std::scoped_lock<std::mutex> lock(overflow_mutex_);
+            return pool(id, Classes::class_index(size), std::thread::id()).allocate();
+        }
+
+        return pool(id, Classes::class_index(size), std::this_thread::get_id()).allocate();
+    }
+
+    void deallocate(void *ptr, size_t size) {
+        if (size > Classes::kMaxSize) {
+            free(ptr);
+            return;
+        }
+
+        PoolType::owner(ptr)->deallocate(ptr);
+    }
+
+    void reset() {}
+
+private:
+    PoolType& pool(size_t id, size_t index, std::thread::id owner) {
+        if (threads_[id] == nullptr) {
+            threads_[id] = std::make_unique<Pools>();
+        }
+
+        auto& pool = (*threads_[id])[index];
+        if (pool == nullptr) {
+            pool = std::make_unique<PoolType>(Classes::class_size(index));
+        }
+        if (pool->owner_thread() != owner) {
+            pool->set_owner(owner);
+            if (id != ThreadSlots::kOverflow) {
+                releaser_.backend = this;
+                releaser_.id = id;
+            }
+        }
+        return *pool;
+    }
+
+    void release_owner(size_t id) {
+        for (auto& pool : *threads_[id]) {
+            if (pool != nullptr) {
+                pool->set_owner(std::thread::id());
+            }
+        }
+    }
+};
+
+// An arena per thread. Frees are no-ops, so memory only comes back when all
+// arenas are rewound between iterations.
+class ArenaBackend {
+private:
+    std::array<std::unique_ptr<Arena<>>, ThreadSlots::kMaxThreads + 1> arenas_;
+    std::mutex overflow_mutex_;
+
+public:
+    void* allocate(size_t size) {
+        auto id = ThreadSlots::id();
+        if (id == ThreadSlots::kOverflow) {
+            std::scoped_lock<std::mutex> lock(overflow_mutex_);
+            return arena(id).allocate(size);
+        }
+
+        return arena(id).allocate(size);
+    }
+
+    void deallocate(void *ptr, size_t size) {
+        (void) ptr;
+        (void) size;
+    }
+
+    void reset() {
+        for (auto& arena : arenas_) {
+            if (arena != nullptr) {
+                arena->reset();
+            }
+        }
+    }
+
+private:
+    Arena<>& arena(size_t id) {
+        if (arenas_[id] == nullptr) {
+            arenas_[id] = std::make_unique<Arena<>>();
+        }
+        return *arenas_[id];
+    }
+};
+
+struct Object {
+    void *ptr = nullptr;
+    size_t size = 0;
+};
+
+// Mostly small objects: a power of two between 8 and 1024 bytes, plus up to as much again
+class SizeDistribution {
+private:
+    std::mt19937 rng_;
+    std::uniform_int_distribution<int> shift_{3, 10};
+
+public:
+    explicit SizeDistribution(unsigned seed) : rng_(seed) {}
+
+    size_t operator()() {
+        size_t base = size_t{1} << shift_(rng_);
+        return base + rng_() % base;
+    }
+
+    std::mt19937& rng() {
+        return rng_;
+    }
+};
+
+template <typename Backend>
+Object make_object(Backend& backend, size_t size) {
+    auto ptr = backend.allocate(size);
+    // Touch the object like a real user would, so untouched memory is not free
+    memset(ptr, 0xab, std::min<size_t>(size, 64));
+    return {ptr, size};
+}
+
+template <typename Backend>
+void free_object(Backend& backend, Object& obj) {
+    if (obj.ptr != nullptr) {
+        backend.deallocate(obj.ptr, obj.size);
+        obj.ptr = nullptr;
+    }
+}
+
+template <typename F>
+void run_threads(int num_threads, F&& f) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back(f, t);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Bounded queue of batches handed from a producer to its consumer
+class Channel {
+private:
+    static constexpr size_t kCapacity = 16;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<std::vector<Object>> batches_;
+
+public:
+    void push(std::vector<Object> batch) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return batches_.size() < kCapacity; });
+        batches_.push_back(std::move(batch));
+        not_empty_.notify_one();
+    }
+
+    std::vector<Object> pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return !batches_.empty(); });
+        auto batch = std::move(batches_.front());
+        batches_.pop_front();
+        not_full_.notify_one();
+        return batch;
+    }
+};
+
+// Half of the threads allocate messages, the other half frees them, so every
+// free is a remote free. A single thread consumes its own batches.
+template <typename Backend>
+void BM_ProducerConsumer(benchmark::State& state) {
+    constexpr const int kBatches = 1000;
+    constexpr const int kBatchSize = 64;
+    const int num_threads = state.range(0);
+    const int num_pairs = std::max(num_threads / 2, 1);
+    Backend backend;
+
+    for (auto _ : state) {
+        std::vector<Channel> channels(num_pairs);
+
+        auto produce = [&](int pair, SizeDistribution& sizes) {
+            std::vector<Object> batch;
+            for (int j = 0; j < kBatchSize; j++) {
+                batch.push_back(make_object(backend, sizes()));
+            }
+            channels[pair].push(std::move(batch));
+        };
+
+        auto consume = [&](int pair) {
+            for (auto& obj : channels[pair].pop()) {
+                free_object(backend, obj);
+            }
+        };
+
+        run_threads(num_threads, [&](int t) {
+            SizeDistribution sizes(t);
+            if (num_threads == 1) {
+                for (int i = 0; i < kBatches; i++) {
+                    produce(0, sizes);
+                    consume(0);
+                }
+            } else if (t < num_pairs) {
+                for (int i = 0; i < kBatches; i++) {
+                    produce(t, sizes);
+                }
+            } else if (t < 2 * num_pairs) {
+                for (int i = 0; i < kBatches; i++) {
+                    consume(t - num_pairs);
+                }
+            }
+        });
+
+        backend.reset();
+    }
+
+    set_operations(state, int64_t{kBatches} * kBatchSize * num_pairs);
+}
+
+// Every thread keeps a window of live objects and keeps replacing random ones
+template <typename Backend>
+void BM_RandomChurn(benchmark::State& state) {
+    constexpr const int kLiveObjects = 1024;
+    constexpr const int kOperations = 1 << 15;
+    const int num_threads = state.range(0);
+    Backend backend;
+
+    for (auto _ : state) {
+        run_threads(num_threads, [&](int t) {
+            SizeDistribution sizes(t);
+            std::vector<Object> live(kLiveObjects);
+            for (int i = 0; i < kOperations; i++) {
+                auto& obj = live[sizes.rng()() % kLiveObjects];
+                free_object(backend, obj);
+                obj = make_object(backend, sizes());
+            }
+
+            for (auto& obj : live) {
+                free_object(backend, obj);
+            }
+        });
+
+        backend.reset();
+    }
+
+    set_operations(state, int64_t{kOperations} * num_threads);
+}
+
+/* Larson-style server: each thread churns through the long-lived objects of an
+   array, next to short-lived objects it frees right away. Every generation is
+   a new set of threads and each array moves on to the next thread, so the
+   long-lived objects are freed by other threads than the ones allocating them. */
+template <typename Backend>
+void BM_Larson(benchmark::State& state) {
+    constexpr const int kGenerations = 4;
+    constexpr const int kLongLived = 4096;
+    constexpr const int kOperations = 1 << 13;
+    constexpr const int kShortLivedPerOperation = 2;
+    const int num_threads = state.range(0);
+    Backend backend;
+
+    for (auto _ : state) {
+        std::vector<std::vector<Object>> arrays(num_threads, std::vector<Object>(kLongLived));
+
+        for (int g = 0; g < kGenerations; g++) {
+            run_threads(num_threads, [&](int t) {
+                SizeDistribution sizes(g * num_threads + t);
+                auto& long_lived = arrays[(t + g) % num_threads];
+                for (int i = 0; i < kOperations; i++) {
+                    auto& obj = long_lived[sizes.rng()() % kLongLived];
+                    free_object(backend, obj);
+                    obj = make_object(backend, sizes());
+
+                    for (int j = 0; j < kShortLivedPerOperation; j++) {
+                        auto tmp = make_object(backend, sizes());
+                        free_object(backend, tmp);
+                    }
+                }
+            });
+        }
+
+        run_threads(num_threads, [&](int t) {
+            for (auto& obj : arrays[t]) {
+                free_object(backend, obj);
+            }
+        });
+
+        backend.reset();
+    }
+
+    set_operations(state, int64_t{kGenerations} * kOperations * (1 + kShortLivedPerOperation) * num_threads);
+}
+
+size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t total = 0, resident = 0;
+    statm >> total >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Fragmentation over time: each round allocates objects of growing sizes and
+   frees all but every 16th, so the survivors pin partially used memory that
+   the next, larger objects cannot reuse. Reports how much resident memory the
+   process gained compared to the bytes that are still live at the end. */
+template <typename Backend>
+void BM_Fragmentation(benchmark::State& state) {
+    constexpr const int kRounds = 6;
+    constexpr const int kObjectsPerRound = 1 << 14;
+    constexpr const int kSurvivorEvery = 16;
+    const int num_threads = state.range(0);
+    Backend backend;
+    double growth = 0;
+    double live = 0;
+
+    for (auto _ : state) {
+        std::vector<std::vector<Object>> survivors(num_threads);
+        std::vector<size_t> live_bytes(num_threads);
+        const auto resident_before = resident_bytes();
+
+        run_threads(num_threads, [&](int t) {
+            SizeDistribution sizes(t);
+            for (int round = 0; round < kRounds; round++) {
+                std::vector<Object> objects;
+                for (int i = 0; i < kObjectsPerRound; i++) {
+                    objects.push_back(make_object(backend, (sizes() >> 3) << (round % 4)));
+                }
+
+                for (int i = 0; i < kObjectsPerRound; i++) {
+                    if (i % kSurvivorEvery == 0) {
+                        live_bytes[t] += objects[i].size;
+                        survivors[t].push_back(objects[i]);
+                    } else {
+                        free_object(backend, objects[i]);
+                    }
+                }
+            }
+        });
+
+        state.PauseTiming();
+        growth = resident_bytes() - static_cast<double>(resident_before);
+        live = 0;
+        for (auto bytes : live_bytes) {
+            live += bytes;
+        }
+        state.ResumeTiming();
+
+        // The survivors of a thread are freed by the next one
+        run_threads(num_threads, [&](int t) {
+            for (auto& obj : survivors[(t + 1) % num_threads]) {
+                free_object(backend, obj);
+            }
+        });
+
+        backend.reset();
+    }
+
+    set_operations(state, int64_t{kRounds} * kObjectsPerRound * num_threads);
+    state.counters["live_MB"] = live / (1 << 20);
+    state.counters["rss_growth_MB"] = growth / (1 << 20);
+}
+
+void thread_counts(benchmark::internal::Benchmark *b) {
+    configure(b);
+    b->UseRealTime()->RangeMultiplier(2)->Range(1, std::max(1u, std::thread::hardware_concurrency()));
+}
+
+using NumaBackend = SizeClassBackend<NumaPool<1 << 16>>;
+
+} // namespace
+
+#define WORKLOAD(name)                                                       \
+    BENCHMARK_TEMPLATE(name, MallocBackend)->Apply(thread_counts);           \
+    BENCHMARK_TEMPLATE(name, LockedSizeClassBackend)->Apply(thread_counts);  \
+    BENCHMARK_TEMPLATE(name, ConcurrentBackend)->Apply(thread_counts);       \
+    BENCHMARK_TEMPLATE(name, NumaBackend)->Apply(thread_counts);             \
+    BENCHMARK_TEMPLATE(name, ThreadOwnedBackend)->Apply(thread_counts);      \
+    BENCHMARK_TEMPLATE(name, ArenaBackend)->Apply(thread_counts)
+
+WORKLOAD(BM_ProducerConsumer);
+WORKLOAD(BM_RandomChurn);
+WORKLOAD(BM_Larson);
+WORKLOAD(BM_Fragmentation);